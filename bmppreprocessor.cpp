@@ -2,14 +2,50 @@
 #include <fstream>
 #include <vector>
 #include <cstring>
-#include <stack>
+#include <cctype>
 #include <cmath>
 #include <array>
 #include <variant>
 #include<functional>
-#include <queue>
-#include <tuple>
 #include <climits> 
+#include <cstdio>
+#include <cstdlib>
+#include <cstddef>
+#include <memory>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <future>
+#include <map>
+#include <list>
+#include <chrono>
+#include <ctime>
+#include <sstream>
+#include <type_traits>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <csignal>
+#include <cerrno>
+#define BMP_HAVE_MMAP 1
+#define BMP_HAVE_SOCKETS 1
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define BMP_HAVE_X86_SIMD 1
+#endif
 #pragma pack(push, 1)
 
 struct BITMAPFILEHEADER {
@@ -40,454 +76,6038 @@ struct RGBTRIPLE {
     uint8_t rgbtRed;
 };
 
-struct CurveContainer {
-    int lineLenght;
-    std::vector<std::array<int, 2>> linePixels;
+struct RGBQUAD {
+    uint8_t rgbBlue;
+    uint8_t rgbGreen;
+    uint8_t rgbRed;
+    uint8_t rgbReserved;
 };
 
 #pragma pack(pop)
 
-int max(std::vector<int> nums) {
-    int res = -1;
-    for (int num : nums) {
-        res = std::max(res, num);
+int clamp(int value, int min, int max) {
+    return std::max(min, std::min(max, value));
+}
+
+// Rows of an Image start on this boundary so whole-row SIMD loads never straddle two allocations.
+const int IMAGE_ROW_ALIGNMENT = 64;
+
+#ifdef BMP_TRACE
+// Stage-level instrumentation, compiled in with -DBMP_TRACE and switched on at run time by setting
+// BMPCV_TRACE to an output path: *.json gets Chrome trace events (chrome://tracing, Perfetto), any
+// other name a flat CSV. Each stage records wall and process CPU time, thread utilisation (CPU time
+// over wall time times pool threads), bytes read and written, pixel buffer allocations and peak live
+// pixel bytes. Counters are process-wide over the stage's interval, so overlapping stages (nested
+// stages, concurrent batch jobs) each see all the traffic that happened meanwhile.
+class Tracer {
+public:
+    struct Stage {
+        std::string name;
+        std::string detail;
+        int thread = 0;
+        double startUs = 0;
+        double wallUs = 0;
+        double cpuUs = 0;
+        double utilisation = 0;
+        uint64_t bytesRead = 0;
+        uint64_t bytesWritten = 0;
+        uint64_t allocations = 0;
+        uint64_t allocatedBytes = 0;
+        uint64_t peakBytes = 0;
+        std::clock_t cpuStart = 0;
+    };
+
+    Tracer() : origin_(std::chrono::steady_clock::now()) {
+        const char* path = std::getenv("BMPCV_TRACE");
+        if (path && *path) {
+            path_ = path;
+            enabled_ = true;
+        }
+    }
+
+    bool enabled() const { return enabled_; }
+    void setThreads(int threads) { threads_ = threads; }
+
+    Stage* begin(std::string name, std::string detail) {
+        auto stage = std::make_unique<Stage>();
+        stage->name = std::move(name);
+        stage->detail = std::move(detail);
+        stage->thread = threadId();
+        stage->startUs = microsecondsSinceStart();
+        stage->cpuStart = std::clock();
+        std::lock_guard<std::mutex> lock(mutex_);
+        stage->peakBytes = liveBytes_;
+        open_.push_back(std::move(stage));
+        return open_.back().get();
+    }
+
+    void end(Stage* stage) {
+        double nowUs = microsecondsSinceStart();
+        std::clock_t cpuEnd = std::clock();
+        std::lock_guard<std::mutex> lock(mutex_);
+        stage->wallUs = nowUs - stage->startUs;
+        stage->cpuUs = double(cpuEnd - stage->cpuStart) * 1e6 / CLOCKS_PER_SEC;
+        stage->utilisation = stage->wallUs > 0 ? stage->cpuUs / (stage->wallUs * std::max(1, threads_)) : 0;
+        for (auto it = open_.begin(); it != open_.end(); ++it) {
+            if (it->get() == stage) {
+                finished_.push_back(std::move(*it));
+                open_.erase(it);
+                break;
+            }
+        }
+    }
+
+    void read(uint64_t bytes) {
+        forOpenStages([&](Stage& stage) { stage.bytesRead += bytes; });
+    }
+    void wrote(uint64_t bytes) {
+        forOpenStages([&](Stage& stage) { stage.bytesWritten += bytes; });
+    }
+    void allocated(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        liveBytes_ += bytes;
+        for (auto& stage : open_) {
+            stage->allocations++;
+            stage->allocatedBytes += bytes;
+            stage->peakBytes = std::max(stage->peakBytes, liveBytes_);
+        }
+    }
+    void released(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        liveBytes_ -= std::min(liveBytes_, bytes);
+    }
+
+    void write() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!enabled_ || finished_.empty()) {
+            return;
+        }
+        std::ofstream file(path_);
+        if (!file) {
+            std::cerr << "Unable to open trace file " << path_ << std::endl;
+            return;
+        }
+        bool json = path_.size() >= 5 && path_.compare(path_.size() - 5, 5, ".json") == 0;
+        if (json) {
+            file << "{\"traceEvents\":[";
+        }
+        else {
+            file << "stage,detail,thread,start_us,wall_us,cpu_us,utilisation,bytes_read,bytes_written,allocations,allocated_bytes,peak_bytes\n";
+        }
+        for (size_t i = 0; i < finished_.size(); i++) {
+            const Stage& stage = *finished_[i];
+            if (json) {
+                file << (i ? ",\n" : "\n") << "{\"name\":\"" << escaped(stage.name) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << stage.thread
+                     << ",\"ts\":" << stage.startUs << ",\"dur\":" << stage.wallUs << ",\"args\":{\"detail\":\"" << escaped(stage.detail)
+                     << "\",\"cpu_us\":" << stage.cpuUs << ",\"utilisation\":" << stage.utilisation << ",\"bytes_read\":" << stage.bytesRead
+                     << ",\"bytes_written\":" << stage.bytesWritten << ",\"allocations\":" << stage.allocations
+                     << ",\"allocated_bytes\":" << stage.allocatedBytes << ",\"peak_bytes\":" << stage.peakBytes << "}}";
+            }
+            else {
+                std::string detail;
+                for (char c : stage.detail) {
+                    detail += c == '"' ? std::string("\"\"") : std::string(1, c);
+                }
+                file << stage.name << ",\"" << detail << "\"," << stage.thread << "," << stage.startUs << "," << stage.wallUs << ","
+                     << stage.cpuUs << "," << stage.utilisation << "," << stage.bytesRead << "," << stage.bytesWritten << ","
+                     << stage.allocations << "," << stage.allocatedBytes << "," << stage.peakBytes << "\n";
+            }
+        }
+        if (json) {
+            file << "\n]}\n";
+        }
+        finished_.clear();
+    }
+
+private:
+    static int threadId() {
+        static std::atomic<int> next{0};
+        thread_local int id = next++;
+        return id;
+    }
+
+    static std::string escaped(const std::string& text) {
+        std::string out;
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+            }
+            out += c;
+        }
+        return out;
+    }
+
+    double microsecondsSinceStart() const {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin_).count();
+    }
+
+    template <typename Fn>
+    void forOpenStages(Fn fn) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& stage : open_) {
+            fn(*stage);
+        }
+    }
+
+    bool enabled_ = false;
+    std::string path_;
+    int threads_ = 1;
+    std::chrono::steady_clock::time_point origin_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Stage>> open_;
+    std::vector<std::unique_ptr<Stage>> finished_;
+    uint64_t liveBytes_ = 0;
+};
+
+// Never destroyed, so stages ending during static destruction are still safe; the trace file is
+// written at exit.
+Tracer& tracer() {
+    static Tracer* instance = [] {
+        Tracer* created = new Tracer();
+        std::atexit([] { tracer().write(); });
+        return created;
+    }();
+    return *instance;
+}
+
+// Times the enclosing block as one stage. `detail` is only evaluated when tracing is on.
+class TraceScope {
+public:
+    template <typename Detail>
+    TraceScope(const char* name, Detail detail) {
+        if (tracer().enabled()) {
+            stage_ = tracer().begin(name, detail());
+        }
+    }
+    TraceScope(std::string name) {
+        if (tracer().enabled()) {
+            stage_ = tracer().begin(std::move(name), std::string());
+        }
+    }
+    ~TraceScope() {
+        if (stage_) {
+            tracer().end(stage_);
+        }
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    Tracer::Stage* stage_ = nullptr;
+};
+
+#define BMP_TRACE_CONCAT_INNER(a, b) a##b
+#define BMP_TRACE_CONCAT(a, b) BMP_TRACE_CONCAT_INNER(a, b)
+#define BMP_TRACE_SCOPE(name) TraceScope BMP_TRACE_CONCAT(traceScope_, __LINE__)(name)
+#define BMP_TRACE_SCOPE_DETAIL(name, detail) TraceScope BMP_TRACE_CONCAT(traceScope_, __LINE__)(name, [&] { return std::string(detail); })
+#define BMP_TRACE_COUNTER(event, bytes) do { if (tracer().enabled()) tracer().event(bytes); } while (0)
+#define BMP_TRACE_THREADS(threads) tracer().setThreads(threads)
+#else
+#define BMP_TRACE_SCOPE(name)
+#define BMP_TRACE_SCOPE_DETAIL(name, detail)
+#define BMP_TRACE_COUNTER(event, bytes) do {} while (0)
+#define BMP_TRACE_THREADS(threads) do {} while (0)
+#endif
+
+// Pixel formats. Images and kernels are templated on one, so the layout is fixed at compile time
+// and inner loops carry no per-pixel format checks. `channels` counts the colour channels analysis
+// looks at. Pipelines run in BGR24, or in Gray8 for grey files; BGRA32 only describes the rows of
+// 32-bit files as they are decoded. The binary format is Bitmask.
+struct BGR24 {
+    using Pixel = RGBTRIPLE;
+    static constexpr int channels = 3;
+    static constexpr int bitCount = 24;
+};
+
+struct BGRA32 {
+    using Pixel = RGBQUAD;
+    static constexpr int channels = 3;
+    static constexpr int bitCount = 32;
+};
+
+struct Gray8 {
+    using Pixel = uint8_t;
+    static constexpr int channels = 1;
+    static constexpr int bitCount = 8;
+};
+
+// Non-owning window onto rows of `Format` pixels; consecutive rows are `stride` bytes apart.
+template <typename Format>
+struct BasicImageView {
+    using Pixel = typename Format::Pixel;
+
+    uint8_t* data = nullptr;
+    int width = 0;
+    int height = 0;
+    ptrdiff_t stride = 0;
+
+    Pixel* operator[](int row) const {
+        return reinterpret_cast<Pixel*>(data + row * stride);
+    }
+    bool empty() const {
+        return width <= 0 || height <= 0;
+    }
+    BasicImageView sub(int row, int col, int rows, int cols) const {
+        return { data + row * stride + col * static_cast<ptrdiff_t>(sizeof(Pixel)), cols, rows, stride };
+    }
+};
+
+using ImageView = BasicImageView<BGR24>;
+using GrayView = BasicImageView<Gray8>;
+
+// Rows [row, row + rows) and columns [col, col + cols) of an image, in the same (row, column)
+// order as pixel indexing.
+struct Rect {
+    int row = 0;
+    int col = 0;
+    int rows = 0;
+    int cols = 0;
+
+    bool empty() const {
+        return rows <= 0 || cols <= 0;
+    }
+    // Grown by `margin` on every side.
+    Rect expanded(int margin) const {
+        return { row - margin, col - margin, rows + 2 * margin, cols + 2 * margin };
+    }
+    // The part inside a width x height image.
+    Rect clipped(int width, int height) const {
+        int top = std::max(row, 0), left = std::max(col, 0);
+        int bottom = std::min<long long>(height, static_cast<long long>(row) + rows);
+        int right = std::min<long long>(width, static_cast<long long>(col) + cols);
+        return { top, left, std::max(0, bottom - top), std::max(0, right - left) };
+    }
+    bool contains(const Rect& other) const {
+        return other.row >= row && other.col >= col && other.row + other.rows <= row + rows && other.col + other.cols <= col + cols;
+    }
+    // The smallest rectangle holding both.
+    Rect united(const Rect& other) const {
+        if (empty()) {
+            return other;
+        }
+        if (other.empty()) {
+            return *this;
+        }
+        int top = std::min(row, other.row), left = std::min(col, other.col);
+        return { top, left, std::max(row + rows, other.row + other.rows) - top, std::max(col + cols, other.col + other.cols) - left };
+    }
+};
+
+// Recycles pixel buffers: released buffers are kept on per-size-class free lists (up to `limit`
+// bytes in total) and handed out again, so repeatedly processing similar images stops allocating.
+// Size classes are quarter steps between powers of two, which wastes at most a quarter of a buffer.
+class PixelPool {
+public:
+    std::shared_ptr<uint8_t> acquire(size_t bytes) {
+        size_t size = sizeClass(std::max<size_t>(bytes, IMAGE_ROW_ALIGNMENT));
+        void* mem = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::vector<void*>& free = free_[size];
+            if (!free.empty()) {
+                mem = free.back();
+                free.pop_back();
+                retained_ -= size;
+            }
+            inUse_ += size;
+            peakInUse_ = std::max(peakInUse_, inUse_);
+        }
+        if (!mem) {
+            mem = std::aligned_alloc(IMAGE_ROW_ALIGNMENT, size);
+            if (!mem) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                inUse_ -= size;
+                throw std::bad_alloc();
+            }
+        }
+        BMP_TRACE_COUNTER(allocated, size);
+        return std::shared_ptr<uint8_t>(static_cast<uint8_t*>(mem), [this, size](uint8_t* buffer) {
+            release(buffer, size);
+        });
+    }
+
+    void setLimit(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        limit_ = bytes;
+        trim();
+    }
+
+    // Most pixel bytes handed out and not yet released at any one time so far.
+    size_t peakInUse() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return peakInUse_;
+    }
+
+private:
+    static size_t sizeClass(size_t bytes) {
+        size_t step = 1;
+        while (step * 8 < bytes) {
+            step <<= 1;
+        }
+        return (bytes + step - 1) / step * step;
+    }
+
+    void release(uint8_t* buffer, size_t size) {
+        BMP_TRACE_COUNTER(released, size);
+        std::lock_guard<std::mutex> lock(mutex_);
+        inUse_ -= size;
+        if (retained_ + size > limit_) {
+            std::free(buffer);
+            return;
+        }
+        free_[size].push_back(buffer);
+        retained_ += size;
+    }
+
+    void trim() {
+        for (auto& [size, free] : free_) {
+            while (retained_ > limit_ && !free.empty()) {
+                std::free(free.back());
+                free.pop_back();
+                retained_ -= size;
+            }
+        }
+    }
+
+    std::mutex mutex_;
+    std::map<size_t, std::vector<void*>> free_;
+    size_t retained_ = 0;
+    size_t limit_ = size_t(256) << 20;
+    size_t inUse_ = 0;
+    size_t peakInUse_ = 0;
+};
+
+// Never destroyed, so buffers released during static destruction still have somewhere to go.
+PixelPool& pixelPool() {
+    static PixelPool* pool = new PixelPool();
+    return *pool;
+}
+
+// Single contiguous, zero-initialised pixel buffer. Copies are deep; use view()/sub() to share pixels.
+template <typename Format>
+class BasicImage {
+public:
+    using Pixel = typename Format::Pixel;
+    using View = BasicImageView<Format>;
+
+    BasicImage() = default;
+    BasicImage(int width, int height) : width_(width), height_(height) {
+        stride_ = alignedStride(width);
+        storage_ = allocatePixels(static_cast<size_t>(stride_) * height);
+        data_ = storage_.get();
+    }
+    explicit BasicImage(const View& src) : BasicImage(src.width, src.height) {
+        for (int row = 0; row < height_; row++) {
+            std::memcpy((*this)[row], src[row], width_ * sizeof(Pixel));
+        }
+    }
+    BasicImage(const BasicImage& other) : BasicImage(other.view()) {}
+    BasicImage(BasicImage&& other) noexcept = default;
+    BasicImage& operator=(const BasicImage& other) {
+        if (this != &other) {
+            *this = BasicImage(other.view());
+        }
+        return *this;
+    }
+    BasicImage& operator=(BasicImage&& other) noexcept = default;
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    ptrdiff_t stride() const { return stride_; }
+    bool empty() const { return width_ <= 0 || height_ <= 0; }
+
+    Pixel* operator[](int row) {
+        return reinterpret_cast<Pixel*>(data_ + row * stride_);
+    }
+    const Pixel* operator[](int row) const {
+        return reinterpret_cast<const Pixel*>(data_ + row * stride_);
+    }
+
+    View view() const {
+        return { data_, width_, height_, stride_ };
+    }
+    View sub(int row, int col, int rows, int cols) const {
+        return view().sub(row, col, rows, cols);
+    }
+    operator View() const {
+        return view();
+    }
+
+    // Another handle on the same pixels, keeping them alive without copying. For handing pixels
+    // that will not change any more (e.g. an evaluated pipeline result) to another owner.
+    BasicImage alias() const {
+        return wrap(storage_, data_, width_, height_, stride_);
+    }
+    // Whether another handle shares these pixels.
+    bool aliased() const {
+        return storage_.use_count() > 1;
+    }
+
+    // Adopts rows owned by someone else (e.g. a file mapping); `storage` keeps them alive.
+    static BasicImage wrap(std::shared_ptr<uint8_t> storage, uint8_t* data, int width, int height, ptrdiff_t stride) {
+        BasicImage img;
+        img.storage_ = std::move(storage);
+        img.data_ = data;
+        img.width_ = width;
+        img.height_ = height;
+        img.stride_ = stride;
+        return img;
+    }
+
+    static ptrdiff_t alignedStride(int width) {
+        ptrdiff_t bytes = static_cast<ptrdiff_t>(width) * sizeof(Pixel);
+        return (bytes + IMAGE_ROW_ALIGNMENT - 1) / IMAGE_ROW_ALIGNMENT * IMAGE_ROW_ALIGNMENT;
+    }
+
+private:
+    static std::shared_ptr<uint8_t> allocatePixels(size_t bytes) {
+        std::shared_ptr<uint8_t> pixels = pixelPool().acquire(bytes);
+        std::memset(pixels.get(), 0, bytes);
+        return pixels;
+    }
+
+    std::shared_ptr<uint8_t> storage_;
+    uint8_t* data_ = nullptr;
+    int width_ = 0;
+    int height_ = 0;
+    ptrdiff_t stride_ = 0;
+};
+
+using Image = BasicImage<BGR24>;
+using GrayImage = BasicImage<Gray8>;
+
+// Fixed set of workers, each owning a deque of tasks. Owners pop from the back, idle workers steal
+// from the front of their neighbours' deques. The thread calling parallelFor() works too, so nested
+// calls from inside a task cannot deadlock.
+class ThreadPool {
+public:
+    explicit ThreadPool(int threads) : queues_(std::max(1, threads)) {
+        for (int i = 1; i < size(); i++) {
+            workers_.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (std::thread& worker : workers_) {
+            worker.join();
+        }
+    }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return static_cast<int>(queues_.size()); }
+
+    // While alive, parallelFor calls on this thread run inline. Used inside tasks that already own
+    // a cache-sized piece of work, so nested kernels do not scatter it across cores.
+    struct InlineScope {
+        InlineScope() { inlineDepth_++; }
+        ~InlineScope() { inlineDepth_--; }
+    };
+
+    // Runs task(0) .. task(count - 1) across the pool and returns once all of them finished.
+    void parallelFor(int count, const std::function<void(int)>& task) {
+        if (count <= 0) {
+            return;
+        }
+        if (count == 1 || size() == 1 || inlineDepth_ > 0) {
+            for (int i = 0; i < count; i++) {
+                task(i);
+            }
+            return;
+        }
+        Job job{ &task, {count} };
+        int home = currentPool_ == this ? workerIndex_ : 0;
+        for (int i = 0; i < count; i++) {
+            WorkQueue& queue = queues_[(home + i) % size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back({ &job, i });
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queued_ += count;
+        }
+        wake_.notify_all();
+
+        while (job.remaining.load() > 0) {
+            Task next;
+            if (takeTask(home, next)) {
+                runTask(next);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [&] { return job.remaining.load() == 0 || queued_.load() > 0; });
+        }
+    }
+
+private:
+    struct Job {
+        const std::function<void(int)>* task;
+        std::atomic<int> remaining;
+    };
+    struct Task {
+        Job* job;
+        int index;
+    };
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool takeTask(int home, Task& task) {
+        for (int k = 0; k < size(); k++) {
+            WorkQueue& queue = queues_[(home + k) % size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            if (k == 0) {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            }
+            else {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            queued_--;
+            return true;
+        }
+        return false;
+    }
+
+    void runTask(const Task& task) {
+        (*task.job->task)(task.index);
+        if (task.job->remaining.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            wake_.notify_all();
+        }
+    }
+
+    void workerLoop(int index) {
+        currentPool_ = this;
+        workerIndex_ = index;
+        while (true) {
+            Task next;
+            if (takeTask(index, next)) {
+                runTask(next);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [&] { return stop_ || queued_.load() > 0; });
+            if (stop_) {
+                return;
+            }
+        }
+    }
+
+    std::vector<WorkQueue> queues_;
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::atomic<int> queued_{0};
+    bool stop_ = false;
+
+    inline static thread_local ThreadPool* currentPool_ = nullptr;
+    inline static thread_local int workerIndex_ = 0;
+    inline static thread_local int inlineDepth_ = 0;
+};
+
+std::unique_ptr<ThreadPool> globalThreadPool;
+
+// Replaces the shared pool; 0 means one thread per hardware core.
+void setThreadCount(int threads) {
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    globalThreadPool.reset();
+    globalThreadPool.reset(new ThreadPool(threads));
+    BMP_TRACE_THREADS(threads);
+}
+
+// The shared pool, sized from BMPCV_THREADS (or the core count) on first use.
+ThreadPool& threadPool() {
+    if (!globalThreadPool) {
+        const char* env = std::getenv("BMPCV_THREADS");
+        setThreadCount(env ? std::atoi(env) : 0);
+    }
+    return *globalThreadPool;
+}
+
+// Tiles are sized so one tile of BGR pixels (~48 KB) stays resident in L2 while it is processed.
+const int TILE_ROWS = 64;
+const int TILE_COLS = 256;
+
+// Calls fn(row, col, rows, cols) for every tile of a height x width grid, in parallel. Tiles never
+// overlap, so kernels that only write inside their tile give the same output for any thread count.
+void parallelTiles(int height, int width, const std::function<void(int, int, int, int)>& fn) {
+    if (height <= 0 || width <= 0) {
+        return;
+    }
+    int tilesDown = (height + TILE_ROWS - 1) / TILE_ROWS;
+    int tilesAcross = (width + TILE_COLS - 1) / TILE_COLS;
+    threadPool().parallelFor(tilesDown * tilesAcross, [&](int tile) {
+        int row = tile / tilesAcross * TILE_ROWS;
+        int col = tile % tilesAcross * TILE_COLS;
+        fn(row, col, std::min(TILE_ROWS, height - row), std::min(TILE_COLS, width - col));
+    });
+}
+
+// One bit per pixel, each row padded to whole 64-bit words. Used for visited/skip/edge sets that
+// would otherwise cost a byte (or a full pixel) per entry.
+class Bitmask {
+public:
+    Bitmask() = default;
+    Bitmask(int width, int height)
+        : width_(width), height_(height), wordsPerRow_((width + 63) / 64),
+          bits_(static_cast<size_t>(wordsPerRow_) * height, 0) {}
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int wordsPerRow() const { return wordsPerRow_; }
+
+    bool test(int row, int col) const {
+        return (bits_[static_cast<size_t>(row) * wordsPerRow_ + col / 64] >> (col % 64)) & 1;
+    }
+    void set(int row, int col) {
+        bits_[static_cast<size_t>(row) * wordsPerRow_ + col / 64] |= uint64_t(1) << (col % 64);
+    }
+    void reset(int row, int col) {
+        bits_[static_cast<size_t>(row) * wordsPerRow_ + col / 64] &= ~(uint64_t(1) << (col % 64));
+    }
+    uint64_t* row(int row) {
+        return &bits_[static_cast<size_t>(row) * wordsPerRow_];
+    }
+    const uint64_t* row(int row) const {
+        return &bits_[static_cast<size_t>(row) * wordsPerRow_];
+    }
+
+private:
+    int width_ = 0;
+    int height_ = 0;
+    int wordsPerRow_ = 0;
+    std::vector<uint64_t> bits_;
+};
+
+// Luma of a pixel, with the integer BT.601 weights used wherever colour is reduced to one channel.
+template <typename Format>
+uint8_t lumaOf(const typename Format::Pixel& pixel) {
+    if constexpr (Format::channels == 1) {
+        return pixel;
+    }
+    else {
+        const uint8_t* bgr = reinterpret_cast<const uint8_t*>(&pixel);
+        return static_cast<uint8_t>((29 * bgr[0] + 150 * bgr[1] + 77 * bgr[2] + 128) >> 8);
+    }
+}
+
+// Converts `width` pixels between formats: colour reduces to luma, grey expands to equal channels,
+// alpha is dropped or made opaque.
+template <typename From, typename To>
+void convertRow(const typename From::Pixel* src, typename To::Pixel* dst, int width) {
+    if constexpr (std::is_same_v<From, To>) {
+        std::memcpy(dst, src, width * sizeof(typename To::Pixel));
+    }
+    else if constexpr (std::is_same_v<To, Gray8>) {
+        for (int y = 0; y < width; y++) {
+            dst[y] = lumaOf<From>(src[y]);
+        }
+    }
+    else {
+        for (int y = 0; y < width; y++) {
+            uint8_t* out = reinterpret_cast<uint8_t*>(dst + y);
+            if constexpr (std::is_same_v<From, Gray8>) {
+                out[0] = out[1] = out[2] = src[y];
+            }
+            else {
+                std::memcpy(out, &src[y], 3);
+            }
+            if constexpr (std::is_same_v<To, BGRA32>) {
+                out[3] = 255;
+            }
+        }
+    }
+}
+
+// `img` in another pixel format. This is how images cross between stages that work in different
+// formats, e.g. a colour image entering a luma-only analysis.
+template <typename To, typename From>
+BasicImage<To> convertBMP(const BasicImageView<From>& img) {
+    BasicImage<To> converted(img.width, img.height);
+    int bands = (img.height + TILE_ROWS - 1) / TILE_ROWS;
+    threadPool().parallelFor(bands, [&](int band) {
+        for (int x = band * TILE_ROWS; x < std::min(img.height, (band + 1) * TILE_ROWS); x++) {
+            convertRow<From, To>(img[x], converted[x], img.width);
+        }
+    });
+    return converted;
+}
+
+// A bitmask drawn white on black, the way contour maps are saved.
+template <typename Format = BGR24>
+BasicImage<Format> maskImageBMP(const Bitmask& mask) {
+    BasicImage<Format> img(mask.width(), mask.height());
+    parallelTiles(mask.height(), mask.width(), [&](int row, int col, int rows, int cols) {
+        for (int x = row; x < row + rows; x++) {
+            for (int y = col; y < col + cols; y++) {
+                if (mask.test(x, y)) {
+                    std::memset(&img[x][y], 255, sizeof(typename Format::Pixel));
+                }
+            }
+        }
+    });
+    return img;
+}
+
+// BMP rows are padded to a multiple of 4 bytes.
+size_t bmpRowBytes(int width, int bitCount = 24) {
+    return (static_cast<size_t>(width) * (bitCount / 8) + 3) & ~static_cast<size_t>(3);
+}
+
+// Where the pixel rows of an uncompressed 8-, 24- or 32-bit BMP live inside the file, and the colour
+// table of an 8-bit one (padded to 256 entries; a plain grey ramp is flagged, as it is really Gray8).
+struct BMPLayout {
+    int width;
+    int height;
+    bool topDown;
+    int bitCount;
+    size_t rowBytes;
+    size_t pixelOffset;
+    std::vector<RGBTRIPLE> palette;
+    bool grayPalette;
+};
+
+// Parses the headers and colour table in the first `size` bytes of a file.
+bool parseBMPLayout(const uint8_t* header, size_t size, BMPLayout& layout) {
+    BITMAPFILEHEADER fileHeader;
+    BITMAPINFOHEADER infoHeader;
+    if (size < sizeof(fileHeader) + sizeof(infoHeader)) {
+        std::cerr << "This is not a BMP file" << std::endl;
+        return false;
+    }
+    std::memcpy(&fileHeader, header, sizeof(fileHeader));
+    std::memcpy(&infoHeader, header + sizeof(fileHeader), sizeof(infoHeader));
+    if (fileHeader.bfType != 0x4D42) {
+        std::cerr << "This is not a BMP file" << std::endl;
+        return false;
+    }
+    int bitCount = infoHeader.biBitCount;
+    // 32-bit files often declare BI_BITFIELDS; only the plain BGRA masks are accepted.
+    size_t masksAt = sizeof(fileHeader) + sizeof(infoHeader);
+    const uint32_t bgraMasks[3] = { 0x00FF0000, 0x0000FF00, 0x000000FF };
+    bool bgraFields = bitCount == 32 && infoHeader.biCompression == 3 && size >= masksAt + sizeof(bgraMasks) &&
+                      std::memcmp(header + masksAt, bgraMasks, sizeof(bgraMasks)) == 0;
+    if ((bitCount != 8 && bitCount != 24 && bitCount != 32) || (infoHeader.biCompression != 0 && !bgraFields) ||
+        infoHeader.biWidth <= 0 || infoHeader.biHeight == 0) {
+        std::cerr << "Only uncompressed 8-, 24- and 32-bit BMP files are supported" << std::endl;
+        return false;
+    }
+    layout.width = infoHeader.biWidth;
+    layout.height = std::abs(infoHeader.biHeight);
+    layout.topDown = infoHeader.biHeight < 0;
+    layout.bitCount = bitCount;
+    layout.rowBytes = bmpRowBytes(layout.width, bitCount);
+    layout.pixelOffset = fileHeader.bfOffBits;
+    layout.palette.clear();
+    layout.grayPalette = false;
+    if (bitCount == 8) {
+        size_t entries = infoHeader.biClrUsed > 0 ? std::min<size_t>(infoHeader.biClrUsed, 256) : 256;
+        size_t tableAt = sizeof(fileHeader) + infoHeader.biSize;
+        if (tableAt + entries * sizeof(RGBQUAD) > size) {
+            std::cerr << "BMP file is truncated" << std::endl;
+            return false;
+        }
+        layout.palette.assign(256, RGBTRIPLE{0, 0, 0});
+        layout.grayPalette = true;
+        for (size_t i = 0; i < entries; i++) {
+            const uint8_t* entry = header + tableAt + i * sizeof(RGBQUAD);
+            layout.palette[i] = { entry[0], entry[1], entry[2] };
+            layout.grayPalette &= entry[0] == i && entry[1] == i && entry[2] == i;
+        }
+        // Indices past a short table would read black, not grey.
+        layout.grayPalette &= entries == 256;
+    }
+    return true;
+}
+
+// Reads and parses the headers in front of the pixel rows, leaving `file` just past them.
+bool readBMPLayout(std::ifstream& file, BMPLayout& layout) {
+    std::vector<uint8_t> header(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER));
+    file.read(reinterpret_cast<char*>(header.data()), header.size());
+    if (!file) {
+        std::cerr << "This is not a BMP file" << std::endl;
+        return false;
+    }
+    BITMAPFILEHEADER fileHeader;
+    std::memcpy(&fileHeader, header.data(), sizeof(fileHeader));
+    // The colour table sits between the info header and the pixels; 64 KB is far more than any needs.
+    size_t headerBytes = std::min<size_t>(fileHeader.bfOffBits, 1 << 16);
+    if (headerBytes > header.size()) {
+        size_t have = header.size();
+        header.resize(headerBytes);
+        file.read(reinterpret_cast<char*>(header.data() + have), headerBytes - have);
+        header.resize(have + file.gcount());
+        file.clear();
+    }
+    return parseBMPLayout(header.data(), header.size(), layout);
+}
+
+// Whether rows of `layout` can be used as `Format` pixels as they are.
+template <typename Format>
+bool isNativeBMPLayout(const BMPLayout& layout) {
+    return layout.bitCount == Format::bitCount && (layout.bitCount != 8 || layout.grayPalette);
+}
+
+// Converts `width` pixels of a file row to `Format`: colour-table lookup for 8-bit rows that are not
+// plain grey, then the usual pixel conversion.
+template <typename Format>
+void decodeBMPRow(const uint8_t* raw, const BMPLayout& layout, typename Format::Pixel* dst, int width) {
+    if (layout.bitCount == 8 && !layout.grayPalette) {
+        thread_local std::vector<RGBTRIPLE> expanded;
+        RGBTRIPLE* bgr = reinterpret_cast<RGBTRIPLE*>(dst);
+        if constexpr (!std::is_same_v<Format, BGR24>) {
+            expanded.resize(width);
+            bgr = expanded.data();
+        }
+        for (int y = 0; y < width; y++) {
+            bgr[y] = layout.palette[raw[y]];
+        }
+        convertRow<BGR24, Format>(bgr, dst, width);
+    }
+    else if (layout.bitCount == 8) {
+        convertRow<Gray8, Format>(raw, dst, width);
+    }
+    else if (layout.bitCount == 24) {
+        convertRow<BGR24, Format>(reinterpret_cast<const RGBTRIPLE*>(raw), dst, width);
+    }
+    else {
+        convertRow<BGRA32, Format>(reinterpret_cast<const RGBQUAD*>(raw), dst, width);
+    }
+}
+
+// Decodes `rows` rows of `cols` pixels laid out as in the file (row 0 at `firstRow`, the next
+// `stride` bytes on) to `Format`.
+template <typename Format>
+BasicImage<Format> decodeBMPRows(const uint8_t* firstRow, ptrdiff_t stride, int rows, int cols, const BMPLayout& layout) {
+    BasicImage<Format> pixels(cols, rows);
+    int bands = (rows + TILE_ROWS - 1) / TILE_ROWS;
+    threadPool().parallelFor(bands, [&](int band) {
+        for (int row = band * TILE_ROWS; row < std::min(rows, (band + 1) * TILE_ROWS); row++) {
+            decodeBMPRow<Format>(firstRow + row * stride, layout, pixels[row], cols);
+        }
+    });
+    return pixels;
+}
+
+// Stream fallback for platforms (or files) that cannot be memory-mapped: one seek and read per row
+// of `region`.
+template <typename Format>
+BasicImage<Format> readBMPStream(std::ifstream& file, Rect region) {
+    BMPLayout layout;
+    if (!readBMPLayout(file, layout)) {
+        return BasicImage<Format>();
+    }
+    region = region.clipped(layout.width, layout.height);
+
+    BasicImage<Format> pixels(region.cols, region.rows);
+    bool native = isNativeBMPLayout<Format>(layout);
+    size_t fileBytes = static_cast<size_t>(region.cols) * (layout.bitCount / 8);
+    std::vector<uint8_t> raw(native ? 0 : fileBytes);
+    for (int row = 0; row < region.rows; row++) {
+        int diskRow = layout.topDown ? layout.height - 1 - (region.row + row) : region.row + row;
+        file.seekg(layout.pixelOffset + diskRow * layout.rowBytes + region.col * (layout.bitCount / 8), std::ios::beg);
+        if (native) {
+            file.read(reinterpret_cast<char*>(pixels[row]), fileBytes);
+        }
+        else {
+            file.read(reinterpret_cast<char*>(raw.data()), raw.size());
+            decodeBMPRow<Format>(raw.data(), layout, pixels[row], region.cols);
+        }
+    }
+    if (!file) {
+        std::cerr << "BMP file is truncated" << std::endl;
+        return BasicImage<Format>();
+    }
+    BMP_TRACE_COUNTER(read, fileBytes * region.rows);
+    return pixels;
+}
+
+// Pixels in `region` (clipped to the image) of a whole BMP file held in memory. When the bytes
+// already are `Format` pixels the Image's rows point straight into them; otherwise just the region is
+// converted. Row padding is absorbed by the stride, and top-down files get a negative stride, so row
+// 0 is always the bottom row exactly as with bottom-up files. `mapped` bytes are told which way they
+// will be read.
+template <typename Format>
+BasicImage<Format> decodeBMPBytes(std::shared_ptr<uint8_t> bytes, size_t size, Rect region = { 0, 0, INT_MAX, INT_MAX }, bool mapped = false) {
+    BMPLayout layout;
+    if (!parseBMPLayout(bytes.get(), size, layout)) {
+        return BasicImage<Format>();
+    }
+    if (layout.pixelOffset + layout.rowBytes * layout.height > size) {
+        std::cerr << "BMP file is truncated" << std::endl;
+        return BasicImage<Format>();
+    }
+    region = region.clipped(layout.width, layout.height);
+#ifdef BMP_HAVE_MMAP
+    if (mapped) {
+        bool whole = region.rows == layout.height && region.cols == layout.width;
+        madvise(bytes.get(), size, whole ? MADV_SEQUENTIAL : MADV_RANDOM);
+    }
+#endif
+    BMP_TRACE_COUNTER(read, region.rows * bmpRowBytes(region.cols, layout.bitCount));
+    uint8_t* firstRow = bytes.get() + layout.pixelOffset;
+    ptrdiff_t stride = layout.rowBytes;
+    if (layout.topDown) {
+        firstRow += (layout.height - 1) * layout.rowBytes;
+        stride = -stride;
+    }
+    firstRow += region.row * stride + region.col * (layout.bitCount / 8);
+    if (!isNativeBMPLayout<Format>(layout)) {
+        return decodeBMPRows<Format>(firstRow, stride, region.rows, region.cols, layout);
+    }
+    return BasicImage<Format>::wrap(std::move(bytes), firstRow, region.cols, region.rows, stride);
+}
+
+// Maps the file copy-on-write and returns the pixels in `region` (clipped to the image), decoded by
+// decodeBMPBytes. Native pixels stay in the mapping, so only the pages under the region are ever
+// read.
+template <typename Format>
+BasicImage<Format> readBMPAs(const std::string& path, Rect region = { 0, 0, INT_MAX, INT_MAX }) {
+    BMP_TRACE_SCOPE_DETAIL("decode", path);
+#ifdef BMP_HAVE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Unable to open input file" << std::endl;
+        return BasicImage<Format>();
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)) {
+        close(fd);
+        std::cerr << "This is not a BMP file" << std::endl;
+        return BasicImage<Format>();
+    }
+    size_t fileSize = info.st_size;
+    void* mapped = mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped != MAP_FAILED) {
+        std::shared_ptr<uint8_t> mapping(static_cast<uint8_t*>(mapped), [fileSize](uint8_t* base) {
+            munmap(base, fileSize);
+        });
+        return decodeBMPBytes<Format>(std::move(mapping), fileSize, region, true);
+    }
+#endif
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Unable to open input file" << std::endl;
+        return BasicImage<Format>();
+    }
+    return readBMPStream<Format>(file, region);
+}
+
+// Any supported BMP as BGR24, the format the editing operations work in.
+Image readBMP(const std::string& path) {
+    return readBMPAs<BGR24>(path);
+}
+
+// Only the size and format of a BMP, from its headers.
+bool readBMPLayout(const std::string& path, BMPLayout& layout) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Unable to open input file" << std::endl;
+        return false;
+    }
+    return readBMPLayout(file, layout);
+}
+
+// The editor's "inverse colours" effect: each channel becomes the largest of the three, with the
+// channel itself lifted by 10 first.
+void inverseColorsBMP(const ImageView& img) {
+    parallelTiles(img.height, img.width, [&](int row, int col, int rows, int cols) {
+        for (int x = row; x < row + rows; x++) {
+            for (int y = col; y < col + cols; y++) {
+                RGBTRIPLE pixel = img[x][y];
+                img[x][y].rgbtBlue = static_cast<uint8_t>(std::max({ int(pixel.rgbtRed), std::min(pixel.rgbtBlue + 10, 255), int(pixel.rgbtGreen) }));
+                img[x][y].rgbtGreen = static_cast<uint8_t>(std::max({ int(pixel.rgbtRed), int(pixel.rgbtBlue), std::min(pixel.rgbtGreen + 10, 255) }));
+                img[x][y].rgbtRed = static_cast<uint8_t>(std::max({ std::min(pixel.rgbtRed + 10, 255), int(pixel.rgbtBlue), int(pixel.rgbtGreen) }));
+            }
+        }
+    });
+}
+
+// Per-pixel affine colour transform: out = m * in + offset, with channels in memory order (B, G, R).
+// Coefficients and offset are Q12 fixed point and results are floored, then clamped to 0..255.
+struct ColorMatrix {
+    static const int SHIFT = 12;
+
+    int16_t m[3][3];
+    int32_t offset[3];
+
+    // `matrix[out][in]` and `offset` in B, G, R order; coefficients must stay within (-8, 8).
+    static ColorMatrix fromFloat(const float matrix[3][3], const float offset[3]) {
+        ColorMatrix result;
+        for (int out = 0; out < 3; out++) {
+            for (int in = 0; in < 3; in++) {
+                result.m[out][in] = static_cast<int16_t>(std::lround(matrix[out][in] * (1 << SHIFT)));
+            }
+            result.offset[out] = static_cast<int32_t>(std::lround(offset[out] * (1 << SHIFT)));
+        }
+        return result;
+    }
+
+    // sepiaBMP has always summed the columns of the classic sepia table, which reduces to
+    // independent per-channel gains; keep that so existing outputs do not shift.
+    static ColorMatrix sepia() {
+        const float matrix[3][3] = {
+            {0.189f + 0.168f + 0.131f, 0, 0},
+            {0, 0.769f + 0.686f + 0.534f, 0},
+            {0, 0, 0.393f + 0.349f + 0.272f}
+        };
+        const float offset[3] = {0, 0, 0};
+        return fromFloat(matrix, offset);
+    }
+    // BT.601 luma written to all three channels, rounded.
+    static ColorMatrix grayscale() {
+        return saturation(0);
+    }
+    // Swaps red and blue.
+    static ColorMatrix channelSwap() {
+        const float matrix[3][3] = {{0, 0, 1}, {0, 1, 0}, {1, 0, 0}};
+        const float offset[3] = {0, 0, 0};
+        return fromFloat(matrix, offset);
+    }
+    // 0 gives grayscale, 1 the identity, values above 1 boost colourfulness.
+    static ColorMatrix saturation(float amount) {
+        const float luma[3] = {0.114f, 0.587f, 0.299f};
+        float matrix[3][3];
+        for (int out = 0; out < 3; out++) {
+            for (int in = 0; in < 3; in++) {
+                matrix[out][in] = (1 - amount) * luma[in] + (out == in ? amount : 0);
+            }
+        }
+        const float offset[3] = {0.5f, 0.5f, 0.5f};
+        return fromFloat(matrix, offset);
+    }
+};
+
+void colorMatrixRowScalar(uint8_t* row, int count, const ColorMatrix& cm) {
+    for (int i = 0; i < count; i++, row += 3) {
+        int b = row[0], g = row[1], r = row[2];
+        for (int c = 0; c < 3; c++) {
+            int value = (cm.m[c][0] * b + cm.m[c][1] * g + cm.m[c][2] * r + cm.offset[c]) >> ColorMatrix::SHIFT;
+            row[c] = static_cast<uint8_t>(clamp(value, 0, 255));
+        }
+    }
+}
+
+#ifdef BMP_HAVE_X86_SIMD
+// pshufb controls that split 48 interleaved BGR bytes (three 16-byte blocks) into B, G and R
+// planes of 16 bytes and back again.
+struct BGRShuffles {
+    alignas(16) int8_t split[3][3][16];  // [block][channel]
+    alignas(16) int8_t merge[3][3][16];  // [block][channel]
+
+    BGRShuffles() {
+        for (int block = 0; block < 3; block++) {
+            for (int channel = 0; channel < 3; channel++) {
+                for (int i = 0; i < 16; i++) {
+                    int src = i * 3 + channel - block * 16;
+                    split[block][channel][i] = (src >= 0 && src < 16) ? src : -1;
+                    int pos = block * 16 + i;
+                    merge[block][channel][i] = (pos % 3 == channel) ? pos / 3 : -1;
+                }
+            }
+        }
+    }
+};
+const BGRShuffles bgrShuffles;
+
+// 16 pixels per iteration; the arithmetic is the scalar path's, just 4-8 lanes at a time.
+__attribute__((target("sse4.1")))
+void colorMatrixRowSSE41(uint8_t* row, int count, const ColorMatrix& cm) {
+    __m128i split[3][3], merge[3][3];
+    for (int block = 0; block < 3; block++) {
+        for (int channel = 0; channel < 3; channel++) {
+            split[block][channel] = _mm_load_si128(reinterpret_cast<const __m128i*>(bgrShuffles.split[block][channel]));
+            merge[block][channel] = _mm_load_si128(reinterpret_cast<const __m128i*>(bgrShuffles.merge[block][channel]));
+        }
+    }
+    __m128i coefBG[3], coefR[3], offset[3];
+    for (int c = 0; c < 3; c++) {
+        coefBG[c] = _mm_set1_epi32((static_cast<uint16_t>(cm.m[c][1]) << 16) | static_cast<uint16_t>(cm.m[c][0]));
+        coefR[c] = _mm_set1_epi32(static_cast<uint16_t>(cm.m[c][2]));
+        offset[c] = _mm_set1_epi32(cm.offset[c]);
+    }
+    const __m128i zero = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i + 16 <= count; i += 16, row += 48) {
+        __m128i in[3];
+        for (int block = 0; block < 3; block++) {
+            in[block] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + block * 16));
+        }
+        __m128i plane[3];
+        for (int channel = 0; channel < 3; channel++) {
+            plane[channel] = _mm_or_si128(_mm_or_si128(
+                _mm_shuffle_epi8(in[0], split[0][channel]),
+                _mm_shuffle_epi8(in[1], split[1][channel])),
+                _mm_shuffle_epi8(in[2], split[2][channel]));
+        }
+        // Widen to (B, G) and (R, 0) 16-bit pairs so one madd yields a 32-bit partial dot product.
+        __m128i b16[2] = { _mm_unpacklo_epi8(plane[0], zero), _mm_unpackhi_epi8(plane[0], zero) };
+        __m128i g16[2] = { _mm_unpacklo_epi8(plane[1], zero), _mm_unpackhi_epi8(plane[1], zero) };
+        __m128i r16[2] = { _mm_unpacklo_epi8(plane[2], zero), _mm_unpackhi_epi8(plane[2], zero) };
+        __m128i bg[4], r0[4];
+        for (int half = 0; half < 2; half++) {
+            bg[half * 2] = _mm_unpacklo_epi16(b16[half], g16[half]);
+            bg[half * 2 + 1] = _mm_unpackhi_epi16(b16[half], g16[half]);
+            r0[half * 2] = _mm_unpacklo_epi16(r16[half], zero);
+            r0[half * 2 + 1] = _mm_unpackhi_epi16(r16[half], zero);
+        }
+        __m128i out[3];
+        for (int c = 0; c < 3; c++) {
+            __m128i sum[4];
+            for (int q = 0; q < 4; q++) {
+                sum[q] = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(bg[q], coefBG[c]), _mm_madd_epi16(r0[q], coefR[c])), offset[c]);
+                sum[q] = _mm_srai_epi32(sum[q], ColorMatrix::SHIFT);
+            }
+            out[c] = _mm_packus_epi16(_mm_packs_epi32(sum[0], sum[1]), _mm_packs_epi32(sum[2], sum[3]));
+        }
+        for (int block = 0; block < 3; block++) {
+            __m128i bytes = _mm_or_si128(_mm_or_si128(
+                _mm_shuffle_epi8(out[0], merge[block][0]),
+                _mm_shuffle_epi8(out[1], merge[block][1])),
+                _mm_shuffle_epi8(out[2], merge[block][2]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(row + block * 16), bytes);
+        }
+    }
+    colorMatrixRowScalar(row, count - i, cm);
+}
+
+// 32 pixels per iteration: each 128-bit lane runs the SSE4.1 algorithm on its own 16 pixels, so
+// every shuffle and unpack stays in-lane.
+__attribute__((target("avx2")))
+void colorMatrixRowAVX2(uint8_t* row, int count, const ColorMatrix& cm) {
+    __m256i split[3][3], merge[3][3];
+    for (int block = 0; block < 3; block++) {
+        for (int channel = 0; channel < 3; channel++) {
+            split[block][channel] = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(bgrShuffles.split[block][channel])));
+            merge[block][channel] = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(bgrShuffles.merge[block][channel])));
+        }
+    }
+    __m256i coefBG[3], coefR[3], offset[3];
+    for (int c = 0; c < 3; c++) {
+        coefBG[c] = _mm256_set1_epi32((static_cast<uint16_t>(cm.m[c][1]) << 16) | static_cast<uint16_t>(cm.m[c][0]));
+        coefR[c] = _mm256_set1_epi32(static_cast<uint16_t>(cm.m[c][2]));
+        offset[c] = _mm256_set1_epi32(cm.offset[c]);
+    }
+    const __m256i zero = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i + 32 <= count; i += 32, row += 96) {
+        __m256i in[3];
+        for (int block = 0; block < 3; block++) {
+            in[block] = _mm256_loadu2_m128i(reinterpret_cast<const __m128i*>(row + 48 + block * 16), reinterpret_cast<const __m128i*>(row + block * 16));
+        }
+        __m256i plane[3];
+        for (int channel = 0; channel < 3; channel++) {
+            plane[channel] = _mm256_or_si256(_mm256_or_si256(
+                _mm256_shuffle_epi8(in[0], split[0][channel]),
+                _mm256_shuffle_epi8(in[1], split[1][channel])),
+                _mm256_shuffle_epi8(in[2], split[2][channel]));
+        }
+        __m256i b16[2] = { _mm256_unpacklo_epi8(plane[0], zero), _mm256_unpackhi_epi8(plane[0], zero) };
+        __m256i g16[2] = { _mm256_unpacklo_epi8(plane[1], zero), _mm256_unpackhi_epi8(plane[1], zero) };
+        __m256i r16[2] = { _mm256_unpacklo_epi8(plane[2], zero), _mm256_unpackhi_epi8(plane[2], zero) };
+        __m256i bg[4], r0[4];
+        for (int half = 0; half < 2; half++) {
+            bg[half * 2] = _mm256_unpacklo_epi16(b16[half], g16[half]);
+            bg[half * 2 + 1] = _mm256_unpackhi_epi16(b16[half], g16[half]);
+            r0[half * 2] = _mm256_unpacklo_epi16(r16[half], zero);
+            r0[half * 2 + 1] = _mm256_unpackhi_epi16(r16[half], zero);
+        }
+        __m256i out[3];
+        for (int c = 0; c < 3; c++) {
+            __m256i sum[4];
+            for (int q = 0; q < 4; q++) {
+                sum[q] = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(bg[q], coefBG[c]), _mm256_madd_epi16(r0[q], coefR[c])), offset[c]);
+                sum[q] = _mm256_srai_epi32(sum[q], ColorMatrix::SHIFT);
+            }
+            out[c] = _mm256_packus_epi16(_mm256_packs_epi32(sum[0], sum[1]), _mm256_packs_epi32(sum[2], sum[3]));
+        }
+        for (int block = 0; block < 3; block++) {
+            __m256i bytes = _mm256_or_si256(_mm256_or_si256(
+                _mm256_shuffle_epi8(out[0], merge[block][0]),
+                _mm256_shuffle_epi8(out[1], merge[block][1])),
+                _mm256_shuffle_epi8(out[2], merge[block][2]));
+            _mm256_storeu2_m128i(reinterpret_cast<__m128i*>(row + 48 + block * 16), reinterpret_cast<__m128i*>(row + block * 16), bytes);
+        }
+    }
+    colorMatrixRowSSE41(row, count - i, cm);
+}
+#endif
+
+using ColorMatrixRowKernel = void (*)(uint8_t*, int, const ColorMatrix&);
+
+// Picks the widest row kernel the CPU supports, once.
+ColorMatrixRowKernel colorMatrixRowKernel() {
+    static const ColorMatrixRowKernel kernel = [] {
+#ifdef BMP_HAVE_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return &colorMatrixRowAVX2;
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return &colorMatrixRowSSE41;
+        }
+#endif
+        return &colorMatrixRowScalar;
+    }();
+    return kernel;
+}
+
+void colorMatrixBMP(const ImageView& img, const ColorMatrix& matrix) {
+    ColorMatrixRowKernel kernel = colorMatrixRowKernel();
+    parallelTiles(img.height, img.width, [&](int row, int col, int rows, int cols) {
+        for (int x = row; x < row + rows; x++) {
+            kernel(reinterpret_cast<uint8_t*>(img[x] + col), cols, matrix);
+        }
+    });
+}
+
+void sepiaBMP(const ImageView& img) {
+    colorMatrixBMP(img, ColorMatrix::sepia());
+}
+
+// A per-channel point operation as one 256-entry table per channel (B, G, R in memory order).
+// Composing two tables gives a table, so a whole run of levels, gamma, threshold and the like costs
+// a single lookup per channel.
+struct ChannelLUT {
+    uint8_t table[3][256];
+
+    // The same mapping on every channel; `f` is rounded and clamped to 0..255.
+    template <typename F>
+    static ChannelLUT uniform(F f) {
+        ChannelLUT lut;
+        for (int v = 0; v < 256; v++) {
+            uint8_t mapped = static_cast<uint8_t>(clamp(int(std::lround(f(v))), 0, 255));
+            lut.table[0][v] = lut.table[1][v] = lut.table[2][v] = mapped;
+        }
+        return lut;
+    }
+    static ChannelLUT identity() {
+        return uniform([](int v) { return v; });
+    }
+    static ChannelLUT negative() {
+        return uniform([](int v) { return 255 - v; });
+    }
+    static ChannelLUT brightness(int amount) {
+        return uniform([=](int v) { return v + amount; });
+    }
+    // Stretches (factor > 1) or flattens values around mid-grey.
+    static ChannelLUT contrast(double factor) {
+        return uniform([=](int v) { return 128 + (v - 128) * factor; });
+    }
+    // gamma > 1 brightens the mid-tones, as in most editors.
+    static ChannelLUT gamma(double gamma) {
+        return uniform([=](int v) { return 255 * std::pow(v / 255.0, 1 / gamma); });
+    }
+    static ChannelLUT threshold(int level) {
+        return uniform([=](int v) { return v >= level ? 255 : 0; });
+    }
+    // Maps inLow..inHigh linearly onto outLow..outHigh, clipping outside it.
+    static ChannelLUT levels(int inLow, int inHigh, int outLow, int outHigh) {
+        return uniform([=](int v) {
+            double t = clamp(v, inLow, inHigh) - inLow;
+            return outLow + t * (outHigh - outLow) / std::max(1, inHigh - inLow);
+        });
+    }
+    // Rounds every channel to one of `levels` evenly spaced values.
+    static ChannelLUT posterize(int levels) {
+        int steps = std::max(1, levels - 1);
+        return uniform([=](int v) { return std::lround(v * steps / 255.0) * 255.0 / steps; });
+    }
+
+    // This table followed by `next`.
+    ChannelLUT then(const ChannelLUT& next) const {
+        ChannelLUT composed;
+        for (int c = 0; c < 3; c++) {
+            for (int v = 0; v < 256; v++) {
+                composed.table[c][v] = next.table[c][table[c][v]];
+            }
+        }
+        return composed;
+    }
+    bool isUniform() const {
+        return std::memcmp(table[0], table[1], 256) == 0 && std::memcmp(table[0], table[2], 256) == 0;
+    }
+};
+
+void lutRowScalar(uint8_t* row, int count, const ChannelLUT& lut) {
+    for (int i = 0; i < count; i++, row += 3) {
+        row[0] = lut.table[0][row[0]];
+        row[1] = lut.table[1][row[1]];
+        row[2] = lut.table[2][row[2]];
+    }
+}
+
+#ifdef BMP_HAVE_X86_SIMD
+// 64 pixels (three 64-byte vectors) per iteration. A 256-entry table is four registers, looked up 128
+// entries at a time with vpermi2b, and the index's top bit picks the half. Channels alternate from
+// byte to byte, so unless all three tables are the same every vector is looked up in each and the
+// results are blended by channel.
+template <bool UNIFORM>
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+void lutRowVBMI(uint8_t* row, int count, const ChannelLUT& lut) {
+    // Byte i of vector v holds channel (v + i) % 3, as 64 % 3 == 1.
+    static const auto lanes = [] {
+        const uint64_t everyThird = 0x9249249249249249ull;
+        std::array<std::array<__mmask64, 3>, 3> masks;  // [vector][channel]
+        for (int v = 0; v < 3; v++) {
+            for (int c = 0; c < 3; c++) {
+                masks[v][c] = everyThird << ((c - v + 3) % 3);
+            }
+        }
+        return masks;
+    }();
+    const int tables = UNIFORM ? 1 : 3;
+    __m512i quarters[3][4];
+    for (int c = 0; c < tables; c++) {
+        for (int q = 0; q < 4; q++) {
+            quarters[c][q] = _mm512_loadu_si512(lut.table[c] + 64 * q);
+        }
+    }
+    int i = 0;
+    for (; i + 64 <= count; i += 64, row += 192) {
+        for (int v = 0; v < 3; v++) {
+            __m512i index = _mm512_loadu_si512(row + 64 * v);
+            __mmask64 high = _mm512_movepi8_mask(index);
+            __m512i result = index;
+            for (int c = 0; c < tables; c++) {
+                __m512i low = _mm512_permutex2var_epi8(quarters[c][0], index, quarters[c][1]);
+                __m512i up = _mm512_permutex2var_epi8(quarters[c][2], index, quarters[c][3]);
+                __m512i mapped = _mm512_mask_blend_epi8(high, low, up);
+                result = UNIFORM ? mapped : _mm512_mask_blend_epi8(lanes[v][c], result, mapped);
+            }
+            _mm512_storeu_si512(row + 64 * v, result);
+        }
+    }
+    lutRowScalar(row, count - i, lut);
+}
+#endif
+
+using LUTRowKernel = void (*)(uint8_t*, int, const ChannelLUT&);
+
+// Picks the row kernel for `lut` the CPU supports. x86 before AVX-512 VBMI has no byte shuffle over
+// more than 16 entries, and emulating 256 with pshufb costs more than the plain table loads.
+LUTRowKernel lutRowKernel(const ChannelLUT& lut) {
+#ifdef BMP_HAVE_X86_SIMD
+    static const bool vbmi = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512bw");
+    }();
+    if (vbmi) {
+        return lut.isUniform() ? &lutRowVBMI<true> : &lutRowVBMI<false>;
+    }
+#endif
+    return &lutRowScalar;
+}
+
+void channelLUTBMP(const ImageView& img, const ChannelLUT& lut) {
+    LUTRowKernel kernel = lutRowKernel(lut);
+    parallelTiles(img.height, img.width, [&](int row, int col, int rows, int cols) {
+        for (int x = row; x < row + rows; x++) {
+            kernel(reinterpret_cast<uint8_t*>(img[x] + col), cols, lut);
+        }
+    });
+}
+
+// Grey version for a uniform `lut`: the row kernels see each run of three grey pixels as one BGR
+// pixel, and the last one or two pixels of a tile are looked up directly.
+void channelLUTBMP(const GrayView& img, const ChannelLUT& lut) {
+    LUTRowKernel kernel = lutRowKernel(lut);
+    parallelTiles(img.height, img.width, [&](int row, int col, int rows, int cols) {
+        for (int x = row; x < row + rows; x++) {
+            uint8_t* pixels = img[x] + col;
+            kernel(pixels, cols / 3, lut);
+            for (int y = cols / 3 * 3; y < cols; y++) {
+                pixels[y] = lut.table[0][pixels[y]];
+            }
+        }
+    });
+}
+
+// How neighbourhood kernels read past the image border. Clamp repeats the edge pixel, Mirror
+// reflects about it without repeating it (-1 -> 1).
+enum class EdgeMode { Clamp, Mirror };
+
+int edgeIndex(int i, int size, EdgeMode edge) {
+    if (i >= 0 && i < size) {
+        return i;
+    }
+    if (edge == EdgeMode::Clamp || size == 1) {
+        return clamp(i, 0, size - 1);
+    }
+    int period = 2 * (size - 1);
+    i = std::abs(i) % period;
+    return i < size ? i : period - i;
+}
+
+const float DEFAULT_BLUR_SIGMA = 1.0f;
+// Column strip width of the vertical blur pass; each strip slides its own running sums down the image.
+const int BLUR_STRIP_COLS = 64;
+
+// Radii of three successive box blurs whose combination approximates a Gaussian of `sigma`.
+std::vector<int> gaussianBoxRadii(float sigma) {
+    const int passes = 3;
+    std::vector<int> radii;
+    if (sigma <= 0) {
+        return radii;
+    }
+    double ideal = std::sqrt(12.0 * sigma * sigma / passes + 1);
+    int lower = int(std::floor(ideal));
+    if (lower % 2 == 0) {
+        lower--;
+    }
+    int upper = lower + 2;
+    int lowerPasses = int(std::lround((12.0 * sigma * sigma - passes * lower * lower - 4.0 * passes * lower - 3.0 * passes) / (-4.0 * lower - 4)));
+    for (int i = 0; i < passes; i++) {
+        int radius = (i < lowerPasses ? lower : upper) / 2;
+        if (radius > 0) {
+            radii.push_back(radius);
+        }
+    }
+    return radii;
+}
+
+// Rows (or columns) of context a blur of `sigma` reads on each side of an output pixel.
+int blurHalo(float sigma) {
+    int halo = 0;
+    for (int radius : gaussianBoxRadii(sigma)) {
+        halo += radius;
+    }
+    return halo;
+}
+
+// Sliding-window mean over `count` pixels spaced `step` bytes apart in `src` (which already holds
+// `radius` padding pixels on each side), written to `dst`. Cost per pixel is independent of radius.
+template <int BYTES>
+void boxBlurLine(const uint8_t* src, uint8_t* dst, int count, ptrdiff_t srcStep, ptrdiff_t dstStep, int radius) {
+    const uint64_t window = 2 * radius + 1;
+    const uint64_t reciprocal = ((uint64_t(1) << 32) + window / 2) / window;
+    uint32_t sum[BYTES] = {};
+    for (int k = 0; k <= 2 * radius; k++) {
+        for (int c = 0; c < BYTES; c++) {
+            sum[c] += src[k * srcStep + c];
+        }
+    }
+    for (int x = 0; x < count; x++) {
+        for (int c = 0; c < BYTES; c++) {
+            dst[x * dstStep + c] = static_cast<uint8_t>((sum[c] * reciprocal + (uint64_t(1) << 31)) >> 32);
+        }
+        if (x + 1 < count) {
+            for (int c = 0; c < BYTES; c++) {
+                sum[c] += src[(x + 2 * radius + 1) * srcStep + c] - src[x * srcStep + c];
+            }
+        }
+    }
+}
+
+// One separable box pass of `radius`: rows first, then column strips, each in place through a
+// per-thread padded copy so taps past the border follow `edge` instead of being dropped.
+template <typename Format>
+void boxBlurBMP(const BasicImageView<Format>& img, int radius, EdgeMode edge = EdgeMode::Clamp) {
+    if (radius <= 0 || img.empty()) {
+        return;
+    }
+    int height = img.height, width = img.width;
+    constexpr int bytes = sizeof(typename Format::Pixel);
+
+    int rowGroups = (height + TILE_ROWS - 1) / TILE_ROWS;
+    threadPool().parallelFor(rowGroups, [&](int group) {
+        thread_local std::vector<uint8_t> padded;
+        padded.resize(static_cast<size_t>(width + 2 * radius) * bytes);
+        for (int x = group * TILE_ROWS; x < std::min(height, (group + 1) * TILE_ROWS); x++) {
+            uint8_t* row = reinterpret_cast<uint8_t*>(img[x]);
+            for (int i = -radius; i < width + radius; i++) {
+                std::memcpy(&padded[(i + radius) * bytes], row + edgeIndex(i, width, edge) * bytes, bytes);
+            }
+            boxBlurLine<bytes>(padded.data(), row, width, bytes, bytes, radius);
+        }
+    });
+
+    int strips = (width + BLUR_STRIP_COLS - 1) / BLUR_STRIP_COLS;
+    threadPool().parallelFor(strips, [&](int strip) {
+        int col = strip * BLUR_STRIP_COLS;
+        int cols = std::min(BLUR_STRIP_COLS, width - col);
+        size_t stripBytes = static_cast<size_t>(cols) * bytes;
+        thread_local std::vector<uint8_t> padded;
+        padded.resize(stripBytes * (height + 2 * radius));
+        for (int i = -radius; i < height + radius; i++) {
+            std::memcpy(&padded[(i + radius) * stripBytes], img[edgeIndex(i, height, edge)] + col, stripBytes);
+        }
+        for (int y = 0; y < cols; y++) {
+            boxBlurLine<bytes>(&padded[y * bytes], reinterpret_cast<uint8_t*>(img[0] + col + y), height, stripBytes, img.stride, radius);
+        }
+    });
+}
+
+// Gaussian blur approximated by three box passes, so cost does not grow with sigma.
+template <typename Format>
+void blurBMP(const BasicImageView<Format>& img, float sigma = DEFAULT_BLUR_SIGMA, EdgeMode edge = EdgeMode::Clamp) {
+    for (int radius : gaussianBoxRadii(sigma)) {
+        boxBlurBMP(img, radius, edge);
+    }
+}
+
+// Copies the 4-connected region of pixels within `diffToleration` of the origin pixel's colour
+// onto a black canvas. Scanline fill: each popped seed is grown into a full horizontal run, and
+// only one seed per run of fillable pixels is pushed for the rows above and below.
+template <typename Format>
+BasicImage<Format> shapeDetectorBMP(const BasicImageView<Format>& img, int diffToleration, int shapeOrigin[2]) {
+    int height = img.height, width = img.width;
+    int originX = shapeOrigin[0], originY = shapeOrigin[1];
+    BasicImage<Format> shape_detected_img(width, height);
+    if (originX < 0 || originY < 0 || originX >= height || originY >= width) {
+        std::cerr << "Shape origin is outside the image" << std::endl;
+        return shape_detected_img;
+    }
+
+    const uint8_t* originColor = reinterpret_cast<const uint8_t*>(&img[originX][originY]);
+    Bitmask visited(width, height);
+    auto isFillable = [&](int x, int y) {
+        if (visited.test(x, y)) {
+            return false;
+        }
+        const uint8_t* pixel = reinterpret_cast<const uint8_t*>(&img[x][y]);
+        for (int c = 0; c < Format::channels; c++) {
+            if (std::abs(pixel[c] - originColor[c]) > diffToleration) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    std::vector<std::pair<int, int>> stack;
+    stack.push_back({ originX, originY });
+    while (!stack.empty()) {
+        auto [x, y] = stack.back();
+        stack.pop_back();
+        if (!isFillable(x, y)) {
+            continue;
+        }
+
+        int left = y, right = y;
+        while (left > 0 && isFillable(x, left - 1)) {
+            left--;
+        }
+        while (right + 1 < width && isFillable(x, right + 1)) {
+            right++;
+        }
+        for (int col = left; col <= right; col++) {
+            visited.set(x, col);
+        }
+        std::memcpy(shape_detected_img[x] + left, img[x] + left, (right - left + 1) * sizeof(typename Format::Pixel));
+
+        for (int nx : { x - 1, x + 1 }) {
+            if (nx < 0 || nx >= height) {
+                continue;
+            }
+            bool inRun = false;
+            for (int col = left; col <= right; col++) {
+                bool fillable = isFillable(nx, col);
+                if (fillable && !inRun) {
+                    stack.push_back({ nx, col });
+                }
+                inRun = fillable;
+            }
+        }
+    }
+    return shape_detected_img;
+}
+
+// Per-channel (B, G, R) totals of pixel values, or of their squares.
+using ChannelSums = std::array<uint64_t, 3>;
+
+// Population variance per channel of `count` pixels with the given totals.
+std::array<double, 3> varianceOf(const ChannelSums& total, const ChannelSums& squares, uint64_t count) {
+    std::array<double, 3> result = { 0, 0, 0 };
+    for (int c = 0; c < 3 && count > 0; c++) {
+        double mean = double(total[c]) / count;
+        result[c] = std::max(0.0, double(squares[c]) / count - mean * mean);
+    }
+    return result;
+}
+
+// Summary of one connected region of a RegionIndex.
+struct RegionInfo {
+    int area = 0;
+    int top = 0, left = 0, bottom = -1, right = -1;  // inclusive row/column bounds
+    RGBTRIPLE meanColor = {0, 0, 0};
+    std::array<double, 3> variance = {0, 0, 0};  // per channel, B, G, R
+};
+
+// Labels the whole image once so that many seed queries are answered by lookup instead of one
+// flood fill each. Two 4-neighbours join the same region when every channel differs by at most
+// `diffToleration`. Note this chains colour similarity from pixel to pixel, whereas
+// shapeDetectorBMP compares every pixel with the seed's colour, so regions can be larger.
+//
+// Tiles are labelled in parallel with a union-find over pixel indices (the smaller index always
+// wins, so labels are deterministic), tile borders are stitched sequentially, and roots are then
+// renumbered 0..regionCount()-1 in scan order.
+class RegionIndex {
+public:
+    RegionIndex(const ImageView& img, int diffToleration) : width_(img.width), height_(img.height) {
+        size_t pixels = static_cast<size_t>(width_) * height_;
+        std::vector<int32_t> parent(pixels);
+        auto similar = [&](const RGBTRIPLE& a, const RGBTRIPLE& b) {
+            return std::abs(a.rgbtBlue - b.rgbtBlue) <= diffToleration &&
+                   std::abs(a.rgbtGreen - b.rgbtGreen) <= diffToleration &&
+                   std::abs(a.rgbtRed - b.rgbtRed) <= diffToleration;
+        };
+        auto find = [&](int32_t i) {
+            while (parent[i] != i) {
+                parent[i] = parent[parent[i]];
+                i = parent[i];
+            }
+            return i;
+        };
+        auto unite = [&](int32_t a, int32_t b) {
+            a = find(a);
+            b = find(b);
+            if (a < b) {
+                parent[b] = a;
+            }
+            else if (b < a) {
+                parent[a] = b;
+            }
+        };
+
+        parallelTiles(height_, width_, [&](int row, int col, int rows, int cols) {
+            for (int x = row; x < row + rows; x++) {
+                for (int y = col; y < col + cols; y++) {
+                    int32_t i = index(x, y);
+                    parent[i] = i;
+                    if (y > col && similar(img[x][y], img[x][y - 1])) {
+                        unite(i, i - 1);
+                    }
+                    if (x > row && similar(img[x][y], img[x - 1][y])) {
+                        unite(i, i - width_);
+                    }
+                }
+            }
+        });
+        for (int x = TILE_ROWS; x < height_; x += TILE_ROWS) {
+            for (int y = 0; y < width_; y++) {
+                if (similar(img[x][y], img[x - 1][y])) {
+                    unite(index(x, y), index(x - 1, y));
+                }
+            }
+        }
+        for (int y = TILE_COLS; y < width_; y += TILE_COLS) {
+            for (int x = 0; x < height_; x++) {
+                if (similar(img[x][y], img[x][y - 1])) {
+                    unite(index(x, y), index(x, y - 1));
+                }
+            }
+        }
+
+        // Roots are the smallest index of their region, so a scan meets each root before its members.
+        labels_.resize(pixels);
+        for (size_t i = 0; i < pixels; i++) {
+            int32_t root = parent[i];
+            while (parent[root] != root) {
+                root = parent[root];
+            }
+            labels_[i] = root == static_cast<int32_t>(i) ? static_cast<int32_t>(regions_.size()) : labels_[root];
+            if (root == static_cast<int32_t>(i)) {
+                regions_.emplace_back();
+            }
+        }
+
+        // Colour statistics are summed one horizontal run of a label at a time, in the same scan that
+        // finds the runs.
+        std::vector<ChannelSums> sums(regions_.size(), {0, 0, 0}), squares(regions_.size(), {0, 0, 0});
+        for (int x = 0; x < height_; x++) {
+            for (int y = 0; y < width_;) {
+                int32_t label = labels_[index(x, y)];
+                int runEnd = y + 1;
+                while (runEnd < width_ && labels_[index(x, runEnd)] == label) {
+                    runEnd++;
+                }
+                RegionInfo& region = regions_[label];
+                if (region.area == 0) {
+                    region.top = x;
+                    region.left = y;
+                }
+                region.area += runEnd - y;
+                region.bottom = x;
+                region.left = std::min(region.left, y);
+                region.right = std::max(region.right, runEnd - 1);
+                const uint8_t* run = reinterpret_cast<const uint8_t*>(img[x]);
+                for (int c = 0; c < 3; c++) {
+                    uint64_t sum = 0, square = 0;
+                    for (int k = y; k < runEnd; k++) {
+                        uint64_t value = run[3 * k + c];
+                        sum += value;
+                        square += value * value;
+                    }
+                    sums[label][c] += sum;
+                    squares[label][c] += square;
+                }
+                y = runEnd;
+            }
+        }
+        for (size_t label = 0; label < regions_.size(); label++) {
+            uint64_t area = regions_[label].area;
+            regions_[label].meanColor = {
+                static_cast<uint8_t>((sums[label][0] + area / 2) / area),
+                static_cast<uint8_t>((sums[label][1] + area / 2) / area),
+                static_cast<uint8_t>((sums[label][2] + area / 2) / area)
+            };
+            regions_[label].variance = varianceOf(sums[label], squares[label], area);
+        }
+    }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int regionCount() const { return static_cast<int>(regions_.size()); }
+
+    int label(int row, int col) const { return labels_[index(row, col)]; }
+    const RegionInfo& region(int label) const { return regions_[label]; }
+
+    // Pixels of region `label`; cost is proportional to the region's bounding box.
+    Bitmask mask(int label) const {
+        Bitmask result(width_, height_);
+        const RegionInfo& info = regions_[label];
+        for (int x = info.top; x <= info.bottom; x++) {
+            for (int y = info.left; y <= info.right; y++) {
+                if (labels_[index(x, y)] == label) {
+                    result.set(x, y);
+                }
+            }
+        }
+        return result;
+    }
+
+    // Copies the pixels of region `label` from `img` into `canvas`, like shapeDetectorBMP does.
+    void paint(const ImageView& img, int label, const ImageView& canvas) const {
+        const RegionInfo& info = regions_[label];
+        for (int x = info.top; x <= info.bottom; x++) {
+            for (int y = info.left; y <= info.right; y++) {
+                if (labels_[index(x, y)] == label) {
+                    canvas[x][y] = img[x][y];
+                }
+            }
+        }
+    }
+
+private:
+    int32_t index(int row, int col) const {
+        return static_cast<int32_t>(row) * width_ + col;
+    }
+
+    int width_;
+    int height_;
+    std::vector<int32_t> labels_;
+    std::vector<RegionInfo> regions_;
+};
+
+// How edge strength (0..255) is measured. MaxChannelDifference is the largest per-channel
+// difference to any of the 8 neighbours, which is what contourBMP has always thresholded. Sobel and
+// Scharr use the L1 gradient magnitude of BT.601 luma, scaled so a full black/white step saturates.
+enum class EdgeOperator { MaxChannelDifference, Sobel, Scharr };
+
+template <typename Format>
+void maxChannelDiffRowScalar(const BasicImageView<Format>& img, int x, int first, int last, uint8_t* strength) {
+    for (int y = first; y < last; y++) {
+        const uint8_t* center = reinterpret_cast<const uint8_t*>(&img[x][y]);
+        int best = 0;
+        for (int dx = -1; dx <= 1; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                int nx = x + dx, ny = y + dy;
+                if (nx < 0 || ny < 0 || nx >= img.height || ny >= img.width) {
+                    continue;
+                }
+                const uint8_t* other = reinterpret_cast<const uint8_t*>(&img[nx][ny]);
+                for (int c = 0; c < Format::channels; c++) {
+                    best = std::max(best, std::abs(center[c] - other[c]));
+                }
+            }
+        }
+        strength[y] = static_cast<uint8_t>(best);
+    }
+}
+
+void gradientRowScalar(const uint8_t* above, const uint8_t* row, const uint8_t* below, int width, int first, int last, int side, int middle, int shift, uint8_t* strength) {
+    for (int y = first; y < last; y++) {
+        int l = std::max(y - 1, 0), r = std::min(y + 1, width - 1);
+        int gx = side * (above[r] - above[l]) + middle * (row[r] - row[l]) + side * (below[r] - below[l]);
+        int gy = side * (below[l] - above[l]) + middle * (below[y] - above[y]) + side * (below[r] - above[r]);
+        strength[y] = static_cast<uint8_t>(std::min(255, (std::abs(gx) + std::abs(gy)) >> shift));
+    }
+}
+
+#ifdef BMP_HAVE_X86_SIMD
+// Interior pixels [first, last) of row x, 16 at a time: byte-wise absolute differences against the
+// 8 neighbours are max-reduced on the interleaved data, and only the result is split into planes.
+__attribute__((target("sse4.1")))
+int maxChannelDiffRowSSE41(const ImageView& img, int x, int first, int last, uint8_t* strength) {
+    __m128i split[3][3];
+    for (int block = 0; block < 3; block++) {
+        for (int channel = 0; channel < 3; channel++) {
+            split[block][channel] = _mm_load_si128(reinterpret_cast<const __m128i*>(bgrShuffles.split[block][channel]));
+        }
+    }
+    const uint8_t* rows[3] = {
+        reinterpret_cast<const uint8_t*>(img[x - 1]), reinterpret_cast<const uint8_t*>(img[x]), reinterpret_cast<const uint8_t*>(img[x + 1])
+    };
+    int y = first;
+    for (; y + 16 <= last; y += 16) {
+        const uint8_t* center = rows[1] + y * 3;
+        __m128i c[3], d[3];
+        for (int block = 0; block < 3; block++) {
+            c[block] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(center + block * 16));
+            d[block] = _mm_setzero_si128();
+        }
+        for (int dx = 0; dx < 3; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                if (dx == 1 && dy == 0) {
+                    continue;
+                }
+                const uint8_t* other = rows[dx] + (y + dy) * 3;
+                for (int block = 0; block < 3; block++) {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(other + block * 16));
+                    __m128i diff = _mm_or_si128(_mm_subs_epu8(c[block], v), _mm_subs_epu8(v, c[block]));
+                    d[block] = _mm_max_epu8(d[block], diff);
+                }
+            }
+        }
+        __m128i result = _mm_setzero_si128();
+        for (int channel = 0; channel < 3; channel++) {
+            __m128i plane = _mm_or_si128(_mm_or_si128(
+                _mm_shuffle_epi8(d[0], split[0][channel]),
+                _mm_shuffle_epi8(d[1], split[1][channel])),
+                _mm_shuffle_epi8(d[2], split[2][channel]));
+            result = _mm_max_epu8(result, plane);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(strength + y), result);
+    }
+    return y;
+}
+
+// Grey version of the above: one byte per pixel, so no channel split is needed.
+__attribute__((target("sse4.1")))
+int maxChannelDiffRowSSE41(const GrayView& img, int x, int first, int last, uint8_t* strength) {
+    const uint8_t* rows[3] = { img[x - 1], img[x], img[x + 1] };
+    int y = first;
+    for (; y + 16 <= last; y += 16) {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[1] + y));
+        __m128i d = _mm_setzero_si128();
+        for (int dx = 0; dx < 3; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                if (dx == 1 && dy == 0) {
+                    continue;
+                }
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[dx] + y + dy));
+                d = _mm_max_epu8(d, _mm_or_si128(_mm_subs_epu8(c, v), _mm_subs_epu8(v, c)));
+            }
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(strength + y), d);
+    }
+    return y;
+}
+
+// Interior luma pixels [first, last), 8 at a time in 16-bit lanes.
+__attribute__((target("sse4.1")))
+int gradientRowSSE41(const uint8_t* above, const uint8_t* row, const uint8_t* below, int first, int last, int side, int middle, int shift, uint8_t* strength) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i sideWeight = _mm_set1_epi16(static_cast<int16_t>(side));
+    const __m128i middleWeight = _mm_set1_epi16(static_cast<int16_t>(middle));
+    const __m128i shiftCount = _mm_cvtsi32_si128(shift);
+    auto load = [&](const uint8_t* p) {
+        return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)), zero);
+    };
+    int y = first;
+    for (; y + 8 <= last; y += 8) {
+        __m128i a0 = load(above + y - 1), a1 = load(above + y), a2 = load(above + y + 1);
+        __m128i m0 = load(row + y - 1), m2 = load(row + y + 1);
+        __m128i b0 = load(below + y - 1), b1 = load(below + y), b2 = load(below + y + 1);
+        __m128i gx = _mm_add_epi16(_mm_add_epi16(
+            _mm_mullo_epi16(_mm_sub_epi16(a2, a0), sideWeight),
+            _mm_mullo_epi16(_mm_sub_epi16(m2, m0), middleWeight)),
+            _mm_mullo_epi16(_mm_sub_epi16(b2, b0), sideWeight));
+        __m128i gy = _mm_add_epi16(_mm_add_epi16(
+            _mm_mullo_epi16(_mm_sub_epi16(b0, a0), sideWeight),
+            _mm_mullo_epi16(_mm_sub_epi16(b1, a1), middleWeight)),
+            _mm_mullo_epi16(_mm_sub_epi16(b2, a2), sideWeight));
+        __m128i magnitude = _mm_srl_epi16(_mm_add_epi16(_mm_abs_epi16(gx), _mm_abs_epi16(gy)), shiftCount);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(strength + y), _mm_packus_epi16(magnitude, zero));
+    }
+    return y;
+}
+#endif
+
+bool edgeSIMDAvailable() {
+#ifdef BMP_HAVE_X86_SIMD
+    static const bool available = (__builtin_cpu_init(), __builtin_cpu_supports("sse4.1"));
+    return available;
+#else
+    return false;
+#endif
+}
+
+// Pixels whose edge strength exceeds `diffToleration`, as a bitmask. Rows are processed in parallel
+// bands; interior pixels take the SIMD path and the one-pixel border the bounds-checked scalar one.
+// Gray8 input is read directly; the other formats compare every colour channel, or are reduced to
+// luma for the gradient operators.
+template <typename Format>
+Bitmask edgeMaskBMP(const BasicImageView<Format>& img, int diffToleration, EdgeOperator op = EdgeOperator::MaxChannelDifference) {
+    int height = img.height, width = img.width;
+    Bitmask edges(width, height);
+    int side = op == EdgeOperator::Scharr ? 3 : 1;
+    int middle = op == EdgeOperator::Scharr ? 10 : 2;
+    int shift = op == EdgeOperator::Scharr ? 5 : 3;
+    bool simd = edgeSIMDAvailable();
+
+    int bands = (height + TILE_ROWS - 1) / TILE_ROWS;
+    threadPool().parallelFor(bands, [&](int band) {
+        int first = band * TILE_ROWS;
+        int last = std::min(height, first + TILE_ROWS);
+        thread_local std::vector<uint8_t> strength, luma;
+        strength.resize(width);
+
+        // Gradient operators work on a luma copy of the band plus one clamped row on each side.
+        if (Format::channels > 1 && op != EdgeOperator::MaxChannelDifference) {
+            luma.resize(static_cast<size_t>(last - first + 2) * width);
+            for (int x = first - 1; x <= last; x++) {
+                convertRow<Format, Gray8>(img[clamp(x, 0, height - 1)], &luma[static_cast<size_t>(x - first + 1) * width], width);
+            }
+        }
+
+        for (int x = first; x < last; x++) {
+            if (op == EdgeOperator::MaxChannelDifference) {
+                bool interiorRow = x > 0 && x + 1 < height && width > 2;
+                int y = interiorRow ? 1 : 0;
+#ifdef BMP_HAVE_X86_SIMD
+                if (simd && interiorRow) {
+                    // A block's right-hand neighbour loads reach one pixel past it, hence width - 1.
+                    y = maxChannelDiffRowSSE41(img, x, 1, width - 1, strength.data());
+                }
+#endif
+                maxChannelDiffRowScalar(img, x, 0, interiorRow ? 1 : 0, strength.data());
+                maxChannelDiffRowScalar(img, x, y, width, strength.data());
+            }
+            else {
+                const uint8_t* above = &luma[static_cast<size_t>(x - first) * width];
+                const uint8_t* row = above + width;
+                const uint8_t* below = row + width;
+                if constexpr (Format::channels == 1) {
+                    above = img[std::max(x - 1, 0)];
+                    row = img[x];
+                    below = img[std::min(x + 1, height - 1)];
+                }
+                int y = 0;
+#ifdef BMP_HAVE_X86_SIMD
+                if (simd && width > 2) {
+                    gradientRowScalar(above, row, below, width, 0, 1, side, middle, shift, strength.data());
+                    y = gradientRowSSE41(above, row, below, 1, width - 1, side, middle, shift, strength.data());
+                }
+#endif
+                gradientRowScalar(above, row, below, width, y, width, side, middle, shift, strength.data());
+            }
+
+            uint64_t* bits = edges.row(x);
+            for (int y = 0; y < width; y++) {
+                if (strength[y] > diffToleration) {
+                    bits[y / 64] |= uint64_t(1) << (y % 64);
+                }
+            }
+        }
+    });
+    return edges;
+}
+
+// True if any bit in columns [lo, hi] of a bitmask row is set.
+bool anyBitSet(const uint64_t* row, int width, int lo, int hi) {
+    lo = std::max(lo, 0);
+    hi = std::min(hi, width - 1);
+    for (int word = lo / 64; word <= hi / 64 && lo <= hi; word++) {
+        uint64_t bits = row[word];
+        if (word == lo / 64) {
+            bits &= ~uint64_t(0) << (lo % 64);
+        }
+        if (word == hi / 64 && hi % 64 != 63) {
+            bits &= (uint64_t(1) << (hi % 64 + 1)) - 1;
+        }
+        if (bits) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Greedy skip-radius pass for row x: an edge pixel is kept unless a kept pixel earlier in scan
+// order lies within Chebyshev distance `skipRadius`. Rows above `boundary` are treated as empty.
+void suppressEdgeRow(const Bitmask& edges, const Bitmask& kept, int x, int boundary, int skipRadius, uint64_t* out) {
+    int width = edges.width();
+    std::fill(out, out + edges.wordsPerRow(), 0);
+    int lastKept = INT_MIN / 2;
+    const uint64_t* candidates = edges.row(x);
+    for (int word = 0; word < edges.wordsPerRow(); word++) {
+        for (uint64_t bits = candidates[word]; bits; bits &= bits - 1) {
+            int y = word * 64 + __builtin_ctzll(bits);
+            if (y - lastKept <= skipRadius) {
+                continue;
+            }
+            bool blocked = false;
+            for (int above = std::max(boundary, x - skipRadius); above < x && !blocked; above++) {
+                blocked = anyBitSet(kept.row(above), width, y - skipRadius, y + skipRadius);
+            }
+            if (!blocked) {
+                out[word] |= uint64_t(1) << (y % 64);
+                lastKept = y;
+            }
+        }
+    }
+}
+
+// Applies skip-radius suppression with the same result as a sequential scan, but in parallel: every
+// band is first solved assuming nothing was kept above it, then bands are corrected top to bottom.
+// A band's correction stops as soon as `skipRadius` consecutive rows match the speculative result,
+// since later rows only ever look that far up - usually a handful of rows per band.
+Bitmask suppressEdgesBMP(const Bitmask& edges, int skipRadius) {
+    if (skipRadius <= 0) {
+        return edges;
+    }
+    int height = edges.height();
+    Bitmask kept(edges.width(), height);
+    int bands = (height + TILE_ROWS - 1) / TILE_ROWS;
+    threadPool().parallelFor(bands, [&](int band) {
+        int first = band * TILE_ROWS;
+        for (int x = first; x < std::min(height, first + TILE_ROWS); x++) {
+            suppressEdgeRow(edges, kept, x, first, skipRadius, kept.row(x));
+        }
+    });
+
+    std::vector<uint64_t> corrected(edges.wordsPerRow());
+    for (int band = 1; band < bands; band++) {
+        int matching = 0;
+        for (int x = band * TILE_ROWS; x < height && matching < skipRadius; x++) {
+            suppressEdgeRow(edges, kept, x, 0, skipRadius, corrected.data());
+            if (std::equal(corrected.begin(), corrected.end(), kept.row(x))) {
+                matching++;
+            }
+            else {
+                matching = 0;
+                std::copy(corrected.begin(), corrected.end(), kept.row(x));
+            }
+        }
+    }
+    return kept;
+}
+
+// suppressEdgesBMP inside `rect` of `edges`, a window of a larger map that goes on beyond its open
+// sides. A pixel is kept unless an earlier neighbour is, so only the neighbours each result of
+// `rect` actually waits on are decided, depth first. Returns false if one lies beyond an open side.
+bool suppressEdgesInside(const Bitmask& edges, int skipRadius, const Rect& rect, bool openTop, bool openLeft, bool openRight, Bitmask& kept) {
+    int width = edges.width(), height = edges.height();
+    int span = 2 * skipRadius + 1;
+    int neighbours = skipRadius + skipRadius * span;
+    // The k-th earlier neighbour: the same row first, nearest first, then the rows above.
+    auto neighbour = [&](int x, int y, int k, int& nx, int& ny) {
+        if (k < skipRadius) {
+            nx = x;
+            ny = y - 1 - k;
+        }
+        else {
+            nx = x - 1 - (k - skipRadius) / span;
+            ny = y - skipRadius + (k - skipRadius) % span;
+        }
+    };
+    struct Pending {
+        int x, y, next;
+    };
+    Bitmask known(width, height);
+    kept = Bitmask(width, height);
+    std::vector<Pending> stack;
+    for (int row = rect.row; row < rect.row + rect.rows; row++) {
+        for (int col = rect.col; col < rect.col + rect.cols; col++) {
+            if (!edges.test(row, col) || known.test(row, col)) {
+                continue;
+            }
+            stack.push_back({ row, col, 0 });
+            while (!stack.empty()) {
+                Pending& top = stack.back();
+                bool blocked = false, waiting = false;
+                int nx = 0, ny = 0;
+                for (; top.next < neighbours; top.next++) {
+                    neighbour(top.x, top.y, top.next, nx, ny);
+                    if (nx >= 0 && ny >= 0 && ny < width) {
+                        if (!edges.test(nx, ny)) {
+                            continue;
+                        }
+                        waiting = !known.test(nx, ny);
+                        blocked = !waiting && kept.test(nx, ny);
+                        if (waiting || blocked) {
+                            break;
+                        }
+                    }
+                    else if ((nx >= 0 || openTop) && (ny >= 0 || openLeft) && (ny < width || openRight)) {
+                        return false;
+                    }
+                }
+                if (waiting) {
+                    stack.push_back({ nx, ny, 0 });
+                    continue;
+                }
+                known.set(top.x, top.y);
+                if (!blocked) {
+                    kept.set(top.x, top.y);
+                }
+                stack.pop_back();
+            }
+        }
+    }
+    return true;
+}
+
+// Edge map of `img` after a light blur: strength above `diffToleration`, before any thinning. Gray8
+// input is blurred and compared in one byte per pixel, a third of the traffic of BGR24.
+//
+// The image is blurred and tested a band of rows at a time, each band copied out with enough rows
+// around it for the blur and the 3x3 test, so the blurred copy never exists at full size. Bands
+// start and end on the image's own rows, so the result is the same as blurring the whole image.
+template <typename Format>
+Bitmask blurredEdgeMaskBMP(const BasicImageView<Format>& img, int diffToleration, EdgeOperator op = EdgeOperator::MaxChannelDifference) {
+    int height = img.height, width = img.width;
+    Bitmask edges(width, height);
+    int halo = blurHalo(DEFAULT_BLUR_SIGMA) + 1;
+    int bandRows = std::max(TILE_ROWS, 4 * halo);
+    int bands = (height + bandRows - 1) / bandRows;
+    threadPool().parallelFor(bands, [&](int band) {
+        ThreadPool::InlineScope inlineKernels;
+        int first = band * bandRows;
+        int last = std::min(height, first + bandRows);
+        int needFirst = std::max(0, first - halo);
+        int needLast = std::min(height, last + halo);
+        BasicImage<Format> mirror_img(img.sub(needFirst, 0, needLast - needFirst, width));
+        blurBMP(mirror_img.view());
+        Bitmask part = edgeMaskBMP(mirror_img.view(), diffToleration, op);
+        for (int x = first; x < last; x++) {
+            std::copy(part.row(x - needFirst), part.row(x - needFirst) + part.wordsPerRow(), edges.row(x));
+        }
+    });
+    return edges;
+}
+
+// blurredEdgeMaskBMP thinned so no two kept pixels are within `skipRadius` of each other.
+template <typename Format>
+Bitmask contourMaskBMP(const BasicImageView<Format>& img, int diffToleration, int skipRadius, EdgeOperator op = EdgeOperator::MaxChannelDifference) {
+    return suppressEdgesBMP(blurredEdgeMaskBMP(img, diffToleration, op), skipRadius);
+}
+
+Image contourBMP(const ImageView& img, int diffToleration, int skipRadius, EdgeOperator op = EdgeOperator::MaxChannelDifference) {
+    return maskImageBMP(contourMaskBMP(img, diffToleration, skipRadius, op));
+}
+
+// Context a contour of part of an image reads around it at first: the blur, the 3x3 edge test, and
+// room for skip-radius suppression (which looks at kept pixels above and to the side) to settle.
+// Pipeline::contourEdges widens it where suppression has not settled.
+int contourRegionHalo(int skipRadius) {
+    return blurHalo(DEFAULT_BLUR_SIGMA) + 1 + 16 * skipRadius;
+}
+
+// Contour settings lineDetectorBMP traces lines on.
+const int LINE_CONTOUR_TOLERANCE = 35;
+const int LINE_CONTOUR_SKIP_RADIUS = 0;
+
+// Hough angle resolution: one accumulator row per degree.
+const int HOUGH_ANGLES = 180;
+const int HOUGH_FIXED_SHIFT = 16;
+
+// A detected segment, in (row, column) image coordinates like everything else here.
+struct LineSegment {
+    int x0, y0;
+    int x1, y1;
+    double length;
+    double angle;  // degrees in [0, 180), measured from the column axis towards increasing rows
+    int votes;
+};
+
+// Finds straight segments among the set pixels of `edges` with a Hough transform.
+//
+// Every edge pixel votes for all (angle, distance) lines through it. Voting is split into one chunk
+// of row bands per thread, each with a private accumulator, and the accumulators are summed, so the
+// result does not depend on scheduling. Local maxima with at least minLength / 2 votes are visited
+// strongest first: the line is walked across the image, a run ends after more than `maxGap`
+// consecutive steps without an edge pixel within one pixel of the line, and runs at least
+// `minLength` long become segments. Pixels within `skipRadius` (at least 1) of an accepted segment
+// are consumed so weaker peaks of the same line do not report it again.
+std::vector<LineSegment> detectLinesBMP(const Bitmask& edges, int maxGap, int minLength, int skipRadius) {
+    int height = edges.height(), width = edges.width();
+    std::vector<LineSegment> segments;
+    if (height <= 0 || width <= 0) {
+        return segments;
+    }
+    int maxRho = int(std::ceil(std::sqrt(double(height) * height + double(width) * width)));
+    int rhoBins = 2 * maxRho + 1;
+    std::vector<int32_t> cosTable(HOUGH_ANGLES), sinTable(HOUGH_ANGLES);
+    for (int t = 0; t < HOUGH_ANGLES; t++) {
+        double theta = t * M_PI / HOUGH_ANGLES;
+        cosTable[t] = int32_t(std::lround(std::cos(theta) * (1 << HOUGH_FIXED_SHIFT)));
+        sinTable[t] = int32_t(std::lround(std::sin(theta) * (1 << HOUGH_FIXED_SHIFT)));
+    }
+    auto rhoOf = [&](int t, int row, int col) {
+        return int((int64_t(col) * cosTable[t] + int64_t(row) * sinTable[t] + (1 << (HOUGH_FIXED_SHIFT - 1))) >> HOUGH_FIXED_SHIFT) + maxRho;
+    };
+
+    size_t cells = size_t(HOUGH_ANGLES) * rhoBins;
+    int chunks = std::max(1, std::min(threadPool().size(), (height + TILE_ROWS - 1) / TILE_ROWS));
+    int rowsPerChunk = (height + chunks - 1) / chunks;
+    std::vector<std::vector<uint32_t>> partial(chunks);
+    threadPool().parallelFor(chunks, [&](int chunk) {
+        std::vector<uint32_t>& votes = partial[chunk];
+        votes.assign(cells, 0);
+        for (int row = chunk * rowsPerChunk; row < std::min(height, (chunk + 1) * rowsPerChunk); row++) {
+            const uint64_t* bits = edges.row(row);
+            for (int word = 0; word < edges.wordsPerRow(); word++) {
+                for (uint64_t set = bits[word]; set; set &= set - 1) {
+                    int col = word * 64 + __builtin_ctzll(set);
+                    for (int t = 0; t < HOUGH_ANGLES; t++) {
+                        votes[size_t(t) * rhoBins + rhoOf(t, row, col)]++;
+                    }
+                }
+            }
+        }
+    });
+    std::vector<uint32_t>& votes = partial[0];
+    threadPool().parallelFor(HOUGH_ANGLES, [&](int t) {
+        for (int chunk = 1; chunk < chunks; chunk++) {
+            for (int rho = 0; rho < rhoBins; rho++) {
+                votes[size_t(t) * rhoBins + rho] += partial[chunk][size_t(t) * rhoBins + rho];
+            }
+        }
+    });
+
+    // Peaks per angle row in parallel, then concatenated in angle order and ranked.
+    uint32_t threshold = std::max(2, minLength / 2);
+    std::vector<std::vector<std::pair<uint32_t, int>>> rowPeaks(HOUGH_ANGLES);
+    threadPool().parallelFor(HOUGH_ANGLES, [&](int t) {
+        for (int rho = 0; rho < rhoBins; rho++) {
+            uint32_t value = votes[size_t(t) * rhoBins + rho];
+            if (value < threshold) {
+                continue;
+            }
+            bool isMax = true;
+            for (int dt = -1; dt <= 1 && isMax; dt++) {
+                for (int dr = -1; dr <= 1 && isMax; dr++) {
+                    int nt = t + dt, nr = rho + dr;
+                    if ((dt || dr) && nt >= 0 && nt < HOUGH_ANGLES && nr >= 0 && nr < rhoBins) {
+                        uint32_t other = votes[size_t(nt) * rhoBins + nr];
+                        // Ties go to the earlier cell so plateaus yield exactly one peak.
+                        isMax = other < value || (other == value && (dt > 0 || (dt == 0 && dr > 0)));
+                    }
+                }
+            }
+            if (isMax) {
+                rowPeaks[t].push_back({ value, t * rhoBins + rho });
+            }
+        }
+    });
+    std::vector<std::pair<uint32_t, int>> peaks;
+    for (const auto& row : rowPeaks) {
+        peaks.insert(peaks.end(), row.begin(), row.end());
+    }
+    std::stable_sort(peaks.begin(), peaks.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+    partial.clear();
+
+    Bitmask remaining = edges;
+    int consumeRadius = std::max(1, skipRadius);
+    auto hasEdgeNear = [&](int row, int col) {
+        int lo = std::max(0, col - 1), hi = std::min(width - 1, col + 1);
+        uint64_t window = ((uint64_t(2) << (hi - lo)) - 1) << (lo % 64);
+        for (int r = std::max(0, row - 1); r <= std::min(height - 1, row + 1); r++) {
+            // The three columns usually share a word; only straddling windows take the general path.
+            if (lo / 64 == hi / 64 ? (remaining.row(r)[lo / 64] & window) != 0 : anyBitSet(remaining.row(r), width, lo, hi)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    for (const auto& [peakVotes, cell] : peaks) {
+        int t = cell / rhoBins;
+        double rho = cell % rhoBins - maxRho;
+        double theta = t * M_PI / HOUGH_ANGLES;
+        // Points on the line: (row, col) = base + s * direction, with |direction| = 1.
+        double baseRow = rho * std::sin(theta), baseCol = rho * std::cos(theta);
+        double dirRow = std::cos(theta), dirCol = -std::sin(theta);
+
+        // Only walk the chord of the line inside the image; most of [-maxRho, maxRho] is outside it.
+        double stepLo = -maxRho, stepHi = maxRho;
+        auto clipAxis = [&](double base, double dir, int size) {
+            if (std::abs(dir) < 1e-9) {
+                if (base < -0.5 || base >= size - 0.5) {
+                    stepLo = 1;
+                    stepHi = 0;
+                }
+                return;
+            }
+            double a = (-0.5 - base) / dir, b = (size - 0.5 - base) / dir;
+            stepLo = std::max(stepLo, std::min(a, b));
+            stepHi = std::min(stepHi, std::max(a, b));
+        };
+        clipAxis(baseRow, dirRow, height);
+        clipAxis(baseCol, dirCol, width);
+        if (stepLo > stepHi) {
+            continue;
+        }
+
+        int runStart = INT_MIN, runEnd = INT_MIN, blank = 0;
+        auto pointAt = [&](int step, int& row, int& col) {
+            // Walked points lie at or beyond -0.5 on both axes, so truncating v + 0.5 rounds them.
+            row = int(baseRow + step * dirRow + 0.5);
+            col = int(baseCol + step * dirCol + 0.5);
+        };
+        auto closeRun = [&]() {
+            if (runStart == INT_MIN) {
+                return;
+            }
+            int x0, y0, x1, y1;
+            pointAt(runStart, x0, y0);
+            pointAt(runEnd, x1, y1);
+            double length = std::hypot(double(x1 - x0), double(y1 - y0));
+            if (length >= minLength) {
+                double angle = std::atan2(double(x1 - x0), double(y1 - y0)) * 180.0 / M_PI;
+                if (angle < 0) {
+                    angle += 180.0;
+                }
+                if (angle >= 180.0) {
+                    angle -= 180.0;
+                }
+                segments.push_back({ x0, y0, x1, y1, length, angle, int(peakVotes) });
+                for (int step = runStart; step <= runEnd; step++) {
+                    int row, col;
+                    pointAt(step, row, col);
+                    for (int r = std::max(0, row - consumeRadius); r <= std::min(height - 1, row + consumeRadius); r++) {
+                        for (int c = std::max(0, col - consumeRadius); c <= std::min(width - 1, col + consumeRadius); c++) {
+                            remaining.reset(r, c);
+                        }
+                    }
+                }
+            }
+            runStart = runEnd = INT_MIN;
+        };
+
+        for (int step = int(std::ceil(stepLo)); step <= int(std::floor(stepHi)); step++) {
+            int row, col;
+            pointAt(step, row, col);
+            if (row < 0 || row >= height || col < 0 || col >= width) {
+                continue;
+            }
+            if (hasEdgeNear(row, col)) {
+                if (runStart == INT_MIN) {
+                    runStart = step;
+                }
+                runEnd = step;
+                blank = 0;
+            }
+            else if (runStart != INT_MIN && ++blank > maxGap) {
+                closeRun();
+                blank = 0;
+            }
+        }
+        closeRun();
+    }
+    return segments;
+}
+
+// Tints the pixels of every segment red, as lineDetectorBMP has always marked lines.
+void drawLinesBMP(const ImageView& img, const std::vector<LineSegment>& segments) {
+    for (const LineSegment& segment : segments) {
+        int steps = std::max(std::abs(segment.x1 - segment.x0), std::abs(segment.y1 - segment.y0));
+        for (int i = 0; i <= steps; i++) {
+            int x = segment.x0 + int(std::lround(double(segment.x1 - segment.x0) * i / std::max(steps, 1)));
+            int y = segment.y0 + int(std::lround(double(segment.y1 - segment.y0) * i / std::max(steps, 1)));
+            if (x < 0 || x >= img.height || y < 0 || y >= img.width) continue;
+            img[x][y].rgbtBlue = 0;
+            img[x][y].rgbtGreen = 0;
+        }
+    }
+}
+
+// Edge pixels of a contourBMP image (white on black).
+Bitmask contourImageMask(const ImageView& contoured_img) {
+    Bitmask edges(contoured_img.width, contoured_img.height);
+    for (int x = 0; x < contoured_img.height; x++) {
+        for (int y = 0; y < contoured_img.width; y++) {
+            if (contoured_img[x][y].rgbtBlue == 255) {
+                edges.set(x, y);
+            }
+        }
+    }
+    return edges;
+}
+
+// Copy of `img` with the lines found on `edges`, a contourMaskBMP map of it, tinted red.
+// maxBlankStreak is the largest gap bridged inside one line, lineLengthMinimum the shortest line kept.
+Image lineDetectorBMP(const ImageView& img, const Bitmask& edges, int maxBlankStreak, int lineLengthMinimum, int skipRadius) {
+    Image lineDetected_img(img);
+    drawLinesBMP(lineDetected_img, detectLinesBMP(edges, maxBlankStreak, lineLengthMinimum, skipRadius));
+    return lineDetected_img;
+}
+
+Image lineDetectorBMP(const ImageView& img, int maxBlankStreak, int lineLengthMinimum, int skipRadius) {
+    return lineDetectorBMP(img, contourMaskBMP(img, LINE_CONTOUR_TOLERANCE, LINE_CONTOUR_SKIP_RADIUS), maxBlankStreak, lineLengthMinimum, skipRadius);
+}
+
+// Resampling kernels: box averaging, or bilinear, Keys cubic or 3-lobe Lanczos interpolation.
+enum class ResampleFilter { Area, Bilinear, Bicubic, Lanczos3 };
+
+// Filter weights along one axis: output sample i is the sum over k < taps of
+// weights[i * taps + k] * input[first[i] + k]. Weights are Q14 and each output's weights sum to
+// exactly 1 << SHIFT. Every output has the same number of taps (zero-padded), and windows are kept
+// inside the input, so kernels never need bounds checks.
+struct ResampleTable {
+    static const int SHIFT = 14;
+    int srcSize = 0;
+    int dstSize = 0;
+    int taps = 0;
+    std::vector<int> first;
+    std::vector<int16_t> weights;
+
+    // Area averages exactly the overlap of each output pixel's footprint with the input pixels; the
+    // other filters are widened by the scale factor when shrinking, so they low-pass before sampling.
+    static ResampleTable build(int srcSize, int dstSize, ResampleFilter filter) {
+        ResampleTable table;
+        table.srcSize = srcSize;
+        table.dstSize = dstSize;
+        if (srcSize <= 0 || dstSize <= 0) {
+            return table;
+        }
+        double scale = double(srcSize) / dstSize;
+        double stretch = std::max(1.0, scale);
+        double support = stretch * (filter == ResampleFilter::Bilinear ? 1 : filter == ResampleFilter::Bicubic ? 2 : 3);
+
+        std::vector<std::vector<double>> outputWeights(dstSize);
+        std::vector<int> windowFirst(dstSize);
+        for (int i = 0; i < dstSize; i++) {
+            int lo, hi;
+            std::vector<double>& w = outputWeights[i];
+            if (filter == ResampleFilter::Area) {
+                double from = i * scale, to = (i + 1) * scale;
+                lo = std::max(0, int(std::floor(from)));
+                hi = std::min(srcSize - 1, int(std::ceil(to)) - 1);
+                for (int j = lo; j <= hi; j++) {
+                    w.push_back(std::max(0.0, std::min(to, j + 1.0) - std::max(from, double(j))));
+                }
+            }
+            else {
+                double center = (i + 0.5) * scale;
+                lo = std::max(0, int(std::floor(center - support)));
+                hi = std::min(srcSize - 1, int(std::ceil(center + support)));
+                for (int j = lo; j <= hi; j++) {
+                    w.push_back(kernel(filter, (j + 0.5 - center) / stretch));
+                }
+            }
+            // Trim zero weights at the ends so the tap count stays as small as possible.
+            while (w.size() > 1 && w.back() == 0) {
+                w.pop_back();
+            }
+            while (w.size() > 1 && w.front() == 0) {
+                w.erase(w.begin());
+                lo++;
+            }
+            windowFirst[i] = lo;
+            table.taps = std::max<int>(table.taps, w.size());
+        }
+
+        table.first.resize(dstSize);
+        table.weights.assign(static_cast<size_t>(dstSize) * table.taps, 0);
+        for (int i = 0; i < dstSize; i++) {
+            const std::vector<double>& w = outputWeights[i];
+            double sum = 0;
+            for (double value : w) {
+                sum += value;
+            }
+            // Slide the window left where it would run past the end; the extra taps weigh nothing.
+            int first = std::min(windowFirst[i], srcSize - table.taps);
+            int offset = windowFirst[i] - first;
+            table.first[i] = first;
+            int16_t* out = &table.weights[static_cast<size_t>(i) * table.taps];
+            int total = 0, largest = offset;
+            for (size_t k = 0; k < w.size(); k++) {
+                out[offset + k] = static_cast<int16_t>(std::lround(w[k] / sum * (1 << SHIFT)));
+                total += out[offset + k];
+                if (out[offset + k] > out[largest]) {
+                    largest = offset + k;
+                }
+            }
+            out[largest] += (1 << SHIFT) - total;
+        }
+        return table;
+    }
+
+    bool identity() const {
+        return srcSize == dstSize && taps == 1;
+    }
+
+    // The inclusive range of input samples that outputs [dstFirst, dstLast) read.
+    void sourceSpan(int dstFirst, int dstLast, int& srcFirst, int& srcLast) const {
+        srcFirst = INT_MAX;
+        srcLast = INT_MIN;
+        for (int i = dstFirst; i < dstLast; i++) {
+            srcFirst = std::min(srcFirst, first[i]);
+            srcLast = std::max(srcLast, first[i] + taps - 1);
+        }
+    }
+
+    // Outputs [dstFirst, dstFirst + count) alone, reading from a window of the input that starts at
+    // sample `srcFirst`. Produces the same values as the full table for those outputs.
+    ResampleTable window(int dstFirst, int count, int srcFirst) const {
+        ResampleTable table;
+        table.dstSize = count;
+        table.taps = taps;
+        if (count <= 0) {
+            return table;
+        }
+        int lo, hi;
+        sourceSpan(dstFirst, dstFirst + count, lo, hi);
+        table.srcSize = hi - srcFirst + 1;
+        table.first.assign(first.begin() + dstFirst, first.begin() + dstFirst + count);
+        for (int& sample : table.first) {
+            sample -= srcFirst;
+        }
+        table.weights.assign(weights.begin() + static_cast<size_t>(dstFirst) * taps, weights.begin() + static_cast<size_t>(dstFirst + count) * taps);
+        return table;
+    }
+
+private:
+    static double kernel(ResampleFilter filter, double x) {
+        x = std::abs(x);
+        switch (filter) {
+        case ResampleFilter::Bilinear:
+            return x < 1 ? 1 - x : 0;
+        case ResampleFilter::Bicubic: {
+            // Keys' cubic convolution with a = -0.5.
+            const double a = -0.5;
+            if (x < 1) {
+                return ((a + 2) * x - (a + 3)) * x * x + 1;
+            }
+            return x < 2 ? ((a * x - 5 * a) * x + 8 * a) * x - 4 * a : 0;
+        }
+        case ResampleFilter::Lanczos3: {
+            if (x < 1e-9) {
+                return 1;
+            }
+            if (x >= 3) {
+                return 0;
+            }
+            double px = M_PI * x;
+            return 3 * std::sin(px) * std::sin(px / 3) / (px * px);
+        }
+        default:
+            return x < 0.5 ? 1 : 0;
+        }
+    }
+};
+
+// Horizontal pass over one row of CHANNELS-byte pixels: `table.dstSize` pixels out. TAPS > 0 fixes
+// the tap count at compile time so the common small filters unroll; 0 reads it from the table.
+template <int CHANNELS, int TAPS>
+void resampleRowHorizontal(const uint8_t* bytes, uint8_t* out, const ResampleTable& table) {
+    const int taps = TAPS > 0 ? TAPS : table.taps;
+    for (int i = 0; i < table.dstSize; i++) {
+        const uint8_t* s = bytes + static_cast<size_t>(table.first[i]) * CHANNELS;
+        const int16_t* w = &table.weights[static_cast<size_t>(i) * taps];
+        int sums[CHANNELS];
+        for (int c = 0; c < CHANNELS; c++) {
+            sums[c] = 1 << (ResampleTable::SHIFT - 1);
+        }
+        for (int k = 0; k < taps; k++) {
+            for (int c = 0; c < CHANNELS; c++) {
+                sums[c] += w[k] * s[CHANNELS * k + c];
+            }
+        }
+        for (int c = 0; c < CHANNELS; c++) {
+            out[CHANNELS * i + c] = static_cast<uint8_t>(clamp(sums[c] >> ResampleTable::SHIFT, 0, 255));
+        }
+    }
+}
+
+template <int CHANNELS>
+void resampleRowHorizontal(const uint8_t* src, uint8_t* dst, const ResampleTable& table) {
+    switch (table.taps) {
+    case 1: return resampleRowHorizontal<CHANNELS, 1>(src, dst, table);
+    case 2: return resampleRowHorizontal<CHANNELS, 2>(src, dst, table);
+    case 3: return resampleRowHorizontal<CHANNELS, 3>(src, dst, table);
+    case 4: return resampleRowHorizontal<CHANNELS, 4>(src, dst, table);
+    case 6: return resampleRowHorizontal<CHANNELS, 6>(src, dst, table);
+    default: return resampleRowHorizontal<CHANNELS, 0>(src, dst, table);
+    }
+}
+
+// Vertical pass: byte i of the output row is the weighted sum of byte i of `rows[0..taps)`.
+void resampleColumnScalar(const uint8_t* const* rows, const int16_t* weights, int taps, uint8_t* dst, int from, int bytes) {
+    for (int i = from; i < bytes; i++) {
+        int sum = 1 << (ResampleTable::SHIFT - 1);
+        for (int k = 0; k < taps; k++) {
+            sum += weights[k] * rows[k][i];
+        }
+        dst[i] = static_cast<uint8_t>(clamp(sum >> ResampleTable::SHIFT, 0, 255));
+    }
+}
+
+#ifdef BMP_HAVE_X86_SIMD
+// 16 bytes at a time: bytes of two rows are interleaved and widened so one madd applies both rows'
+// weights, accumulating in 32-bit lanes; packs saturate the result back to 0..255.
+__attribute__((target("sse4.1")))
+int resampleColumnSSE41(const uint8_t* const* rows, const int16_t* weights, int taps, uint8_t* dst, int bytes) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rounding = _mm_set1_epi32(1 << (ResampleTable::SHIFT - 1));
+    int i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i acc[4] = { rounding, rounding, rounding, rounding };
+        for (int k = 0; k < taps; k += 2) {
+            bool pair = k + 1 < taps;
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k] + i));
+            __m128i b = pair ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k + 1] + i)) : zero;
+            __m128i w = _mm_set1_epi32(static_cast<uint16_t>(weights[k]) | static_cast<int32_t>(static_cast<uint32_t>(static_cast<uint16_t>(pair ? weights[k + 1] : 0)) << 16));
+            __m128i lo = _mm_unpacklo_epi8(a, b), hi = _mm_unpackhi_epi8(a, b);
+            acc[0] = _mm_add_epi32(acc[0], _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+            acc[1] = _mm_add_epi32(acc[1], _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+            acc[2] = _mm_add_epi32(acc[2], _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+            acc[3] = _mm_add_epi32(acc[3], _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+        }
+        for (int j = 0; j < 4; j++) {
+            acc[j] = _mm_srai_epi32(acc[j], ResampleTable::SHIFT);
+        }
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(acc[0], acc[1]), _mm_packs_epi32(acc[2], acc[3]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), packed);
+    }
+    return i;
+}
+#endif
+
+bool resampleSIMDAvailable() {
+#ifdef BMP_HAVE_X86_SIMD
+    static const bool available = (__builtin_cpu_init(), __builtin_cpu_supports("sse4.1"));
+    return available;
+#else
+    return false;
+#endif
+}
+
+// Fills `dst`, whose row 0 is destination row `dstRow0`, from `src`, whose row 0 is source row
+// `srcRow0` and which holds at least the source rows `rowTable` needs for those destination rows.
+// Bands of output rows run in parallel: each resamples its source rows horizontally into a scratch
+// band, then combines scratch rows vertically.
+template <typename Format>
+void resampleRowsBMP(const BasicImageView<Format>& src, int srcRow0, const BasicImageView<Format>& dst, int dstRow0, const ResampleTable& rowTable, const ResampleTable& colTable) {
+    using Pixel = typename Format::Pixel;
+    if (dst.empty()) {
+        return;
+    }
+    if (rowTable.identity() && colTable.identity()) {
+        parallelTiles(dst.height, 1, [&](int row, int, int rows, int) {
+            for (int x = row; x < row + rows; x++) {
+                std::memcpy(dst[x], src[x + dstRow0 - srcRow0], dst.width * sizeof(Pixel));
+            }
+        });
+        return;
+    }
+    bool simd = resampleSIMDAvailable();
+    int bands = (dst.height + TILE_ROWS - 1) / TILE_ROWS;
+    threadPool().parallelFor(bands, [&](int band) {
+        int first = band * TILE_ROWS;
+        int last = std::min(dst.height, first + TILE_ROWS);
+        int srcFirst, srcLast;
+        rowTable.sourceSpan(dstRow0 + first, dstRow0 + last, srcFirst, srcLast);
+
+        thread_local BasicImage<Format> horizontal;
+        int spanRows = srcLast - srcFirst + 1;
+        if (horizontal.width() != dst.width || horizontal.height() < spanRows) {
+            horizontal = BasicImage<Format>(dst.width, spanRows);
+        }
+        for (int r = 0; r < spanRows; r++) {
+            const Pixel* row = src[srcFirst + r - srcRow0];
+            if (colTable.identity()) {
+                std::memcpy(horizontal[r], row, dst.width * sizeof(Pixel));
+            }
+            else {
+                resampleRowHorizontal<sizeof(Pixel)>(reinterpret_cast<const uint8_t*>(row), reinterpret_cast<uint8_t*>(horizontal[r]), colTable);
+            }
+        }
+
+        std::vector<const uint8_t*> rows(rowTable.taps);
+        int bytes = dst.width * sizeof(Pixel);
+        for (int x = first; x < last; x++) {
+            int i = dstRow0 + x;
+            for (int k = 0; k < rowTable.taps; k++) {
+                rows[k] = reinterpret_cast<const uint8_t*>(horizontal[rowTable.first[i] + k - srcFirst]);
+            }
+            const int16_t* weights = &rowTable.weights[static_cast<size_t>(i) * rowTable.taps];
+            uint8_t* out = reinterpret_cast<uint8_t*>(dst[x]);
+            int done = 0;
+#ifdef BMP_HAVE_X86_SIMD
+            if (simd) {
+                done = resampleColumnSSE41(rows.data(), weights, rowTable.taps, out, bytes);
+            }
+#endif
+            resampleColumnScalar(rows.data(), weights, rowTable.taps, out, done, bytes);
+        }
+    });
+}
+
+// 64-bit content hash: four independent multiply-rotate lanes over 32-byte blocks, folded together
+// with the tail and the length. Not cryptographic; used to name cached results.
+uint64_t hashBytes(const void* data, size_t size, uint64_t seed = 0) {
+    const uint64_t prime1 = 0x9E3779B185EBCA87ull, prime2 = 0xC2B2AE3D27D4EB4Full;
+    auto round = [&](uint64_t acc, uint64_t value) {
+        acc += value * prime2;
+        acc = (acc << 31) | (acc >> 33);
+        return acc * prime1;
+    };
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint64_t lanes[4] = { seed + prime1 + prime2, seed + prime2, seed, seed - prime1 };
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t value;
+            std::memcpy(&value, bytes + i + lane * 8, 8);
+            lanes[lane] = round(lanes[lane], value);
+        }
+    }
+    uint64_t hash = round(round(round(round(size, lanes[0]), lanes[1]), lanes[2]), lanes[3]);
+    for (; i < size; i++) {
+        hash = round(hash, bytes[i]);
+    }
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+// Hash of the pixels of `img` (row padding excluded). Bands of rows are hashed in parallel and the
+// band hashes combined in order; bands have a fixed height, so the result is the same for any
+// thread count.
+template <typename Format>
+uint64_t hashPixels(const BasicImageView<Format>& img) {
+    int bands = (img.height + TILE_ROWS - 1) / TILE_ROWS;
+    std::vector<uint64_t> bandHashes(bands + 1);
+    threadPool().parallelFor(bands, [&](int band) {
+        uint64_t hash = 0;
+        for (int x = band * TILE_ROWS; x < std::min(img.height, (band + 1) * TILE_ROWS); x++) {
+            hash = hashBytes(img[x], img.width * sizeof(typename Format::Pixel), hash);
+        }
+        bandHashes[band] = hash;
+    });
+    bandHashes[bands] = (uint64_t(uint32_t(img.width)) << 32) | uint32_t(img.height);
+    return hashBytes(bandHashes.data(), bandHashes.size() * sizeof(uint64_t), Format::bitCount == 24 ? 0 : Format::bitCount);
+}
+
+// Content-addressed store of pipeline results on disk. Each entry is <dir>/<key>.bmpc: a 64-byte
+// header followed by rows at Image's aligned stride, so a hit is mapped straight back into an Image
+// without copying. Hits refresh the file's modification time; when a store takes the directory over
+// `maxBytes`, the least recently used entries are deleted. Several processes may share a directory:
+// entries are written to a temporary name and renamed into place.
+class ResultCache {
+public:
+    static const uint32_t VERSION = 1;
+    static const size_t HEADER_BYTES = 64;
+
+    ResultCache(std::string dir, size_t maxBytes) : dir_(std::move(dir)), maxBytes_(maxBytes) {
+#ifdef BMP_HAVE_MMAP
+        mkdir(dir_.c_str(), 0755);
+#endif
+        bytes_ = scan().second;
+    }
+
+    bool load(uint64_t key, Image& result) {
+#ifdef BMP_HAVE_MMAP
+        BMP_TRACE_SCOPE("cache-load");
+        std::string path = entryPath(key);
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < HEADER_BYTES) {
+            close(fd);
+            return false;
+        }
+        size_t fileSize = info.st_size;
+        void* mapped = mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        std::shared_ptr<uint8_t> mapping(static_cast<uint8_t*>(mapped), [fileSize](uint8_t* base) {
+            munmap(base, fileSize);
+        });
+        Header header;
+        std::memcpy(&header, mapping.get(), sizeof(header));
+        ptrdiff_t stride = Image::alignedStride(header.width);
+        if (std::memcmp(header.magic, "BMPC", 4) != 0 || header.version != VERSION || header.key != key || header.width < 0 || header.height < 0 ||
+            HEADER_BYTES + static_cast<size_t>(stride) * header.height != fileSize) {
+            return false;
+        }
+        utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+        BMP_TRACE_COUNTER(read, fileSize);
+        result = Image::wrap(std::move(mapping), static_cast<uint8_t*>(mapped) + HEADER_BYTES, header.width, header.height, stride);
+        return true;
+#else
+        (void)key;
+        (void)result;
+        return false;
+#endif
+    }
+
+    void store(uint64_t key, const ImageView& pixels) {
+#ifdef BMP_HAVE_MMAP
+        BMP_TRACE_SCOPE("cache-store");
+        ptrdiff_t stride = Image::alignedStride(pixels.width);
+        size_t entryBytes = HEADER_BYTES + static_cast<size_t>(stride) * pixels.height;
+        if (entryBytes > maxBytes_) {
+            return;
+        }
+        std::string path = entryPath(key);
+        std::string temporary = path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        {
+            std::ofstream file(temporary, std::ios::binary);
+            Header header;
+            header.width = pixels.width;
+            header.height = pixels.height;
+            header.key = key;
+            char headerBytes[HEADER_BYTES] = {};
+            std::memcpy(headerBytes, &header, sizeof(header));
+            file.write(headerBytes, HEADER_BYTES);
+            std::vector<char> padding(stride - pixels.width * sizeof(RGBTRIPLE), 0);
+            for (int row = 0; row < pixels.height; row++) {
+                file.write(reinterpret_cast<const char*>(pixels[row]), pixels.width * sizeof(RGBTRIPLE));
+                file.write(padding.data(), padding.size());
+            }
+            if (!file) {
+                std::remove(temporary.c_str());
+                return;
+            }
+        }
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::remove(temporary.c_str());
+            return;
+        }
+        BMP_TRACE_COUNTER(wrote, entryBytes);
+        std::lock_guard<std::mutex> lock(mutex_);
+        bytes_ += entryBytes;
+        if (bytes_ > maxBytes_) {
+            evict();
+        }
+#else
+        (void)key;
+        (void)pixels;
+#endif
+    }
+
+private:
+    struct Header {
+        char magic[4] = { 'B', 'M', 'P', 'C' };
+        uint32_t version = VERSION;
+        int32_t width = 0;
+        int32_t height = 0;
+        uint64_t key = 0;
+    };
+
+    struct Entry {
+        std::string path;
+        size_t bytes;
+        int64_t lastUsed;
+    };
+
+    std::string entryPath(uint64_t key) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.bmpc", static_cast<unsigned long long>(key));
+        return dir_ + "/" + name;
+    }
+
+    // Entries currently in the directory and their total size. Other processes may have added or
+    // removed some since we last looked, so eviction always rescans.
+    std::pair<std::vector<Entry>, size_t> scan() const {
+        std::vector<Entry> entries;
+        size_t total = 0;
+#ifdef BMP_HAVE_MMAP
+        DIR* dir = opendir(dir_.c_str());
+        if (!dir) {
+            return { entries, total };
+        }
+        while (struct dirent* item = readdir(dir)) {
+            std::string name = item->d_name;
+            if (name.size() < 5 || name.compare(name.size() - 5, 5, ".bmpc") != 0) {
+                continue;
+            }
+            std::string path = dir_ + "/" + name;
+            struct stat info;
+            if (stat(path.c_str(), &info) == 0) {
+#ifdef __APPLE__
+                const struct timespec& modified = info.st_mtimespec;
+#else
+                const struct timespec& modified = info.st_mtim;
+#endif
+                entries.push_back({ path, static_cast<size_t>(info.st_size), int64_t(modified.tv_sec) * 1000000000 + modified.tv_nsec });
+                total += info.st_size;
+            }
+        }
+        closedir(dir);
+#endif
+        return { entries, total };
+    }
+
+    void evict() {
+        auto [entries, total] = scan();
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.lastUsed < b.lastUsed; });
+        for (const Entry& entry : entries) {
+            if (total <= maxBytes_) {
+                break;
+            }
+            if (std::remove(entry.path.c_str()) == 0) {
+                total -= entry.bytes;
+            }
+        }
+        bytes_ = total;
+    }
+
+    std::string dir_;
+    size_t maxBytes_;
+    size_t bytes_ = 0;
+    std::mutex mutex_;
+};
+
+std::unique_ptr<ResultCache> globalResultCache;
+bool resultCacheConfigured = false;
+
+// Points every Pipeline created afterwards at the cache in `dir`; an empty dir turns caching off.
+void setResultCache(const std::string& dir, size_t maxBytes) {
+    globalResultCache.reset(dir.empty() ? nullptr : new ResultCache(dir, maxBytes));
+    resultCacheConfigured = true;
+}
+
+// The shared cache, configured from BMPCV_CACHE (directory) and BMPCV_CACHE_MB (size limit, default
+// 1024) on first use; null when caching is off.
+ResultCache* resultCache() {
+    if (!resultCacheConfigured) {
+        const char* dir = std::getenv("BMPCV_CACHE");
+        const char* megabytes = std::getenv("BMPCV_CACHE_MB");
+        setResultCache(dir ? dir : "", size_t(megabytes ? std::max(0, std::atoi(megabytes)) : 1024) << 20);
+    }
+    return globalResultCache.get();
+}
+
+// Lazily evaluated graph of image operations. Building a node only records it; evaluate() walks
+// back to materialised inputs and runs each chain of resample, blur and colour-matrix nodes as one
+// banded sweep, so a chain reads its input and writes its output once instead of once per stage.
+// Requesting a node that already exists with the same input and parameters returns the existing
+// one, so shared intermediates (e.g. the contour map behind line detection) are computed once.
+// With a ResultCache, every materialised node is looked up by a key hashing the source pixels and
+// the ops and parameters leading to it, so a re-run only recomputes what a changed parameter affects.
+class Pipeline {
+public:
+    enum class Op { Source, Resample, ColorMatrix, Blur, Contour, Lines, Shape, PointLUT };
+
+    struct Node {
+        Op op;
+        std::vector<std::shared_ptr<Node>> inputs;
+        std::vector<double> params;
+        int width = 0;
+        int height = 0;
+        int consumers = 0;
+        int consumed = 0;  // consumers computed so far
+        ImageView source;
+        std::function<Image(const Rect&)> read;  // sources supplied with provide()
+        Image result;
+        Bitmask mask;  // Contour nodes keep their edges in the binary format; see evaluate()
+        bool gray = false;  // computed in Gray8 (grayResult) from a grey source; see source(const GrayView&)
+        GrayView graySource;
+        GrayImage grayResult;
+        ResampleTable rowTable;  // Resample nodes: built once with the node
+        ResampleTable colTable;
+        bool evaluated = false;
+        uint64_t key = 0;
+        bool keyed = false;
+    };
+    using NodeRef = std::shared_ptr<Node>;
+
+    NodeRef source(const ImageView& img) {
+        NodeRef node = makeNode(Op::Source, {}, {}, img.width, img.height);
+        node->source = img;
+        node->evaluated = true;
+        return node;
+    }
+    // A grey source. Resampling, point operations, blurs, contours and shapes built on it stay one
+    // byte per pixel, and their nodes are marked `gray`; a colour matrix or line drawing reads its
+    // input converted to BGR, once, when it is evaluated.
+    NodeRef source(const GrayView& img) {
+        NodeRef node = makeNode(Op::Source, {}, {}, img.width, img.height);
+        node->gray = true;
+        node->graySource = img;
+        node->evaluated = true;
+        return node;
+    }
+    // A width x height source whose pixels are supplied later with provide(), so that only the
+    // part a regional evaluation needs has to be read. Regions are always computed in BGR; `gray`
+    // only marks the nodes built on it as it would for a grey source, for callers that store
+    // those results as grey.
+    NodeRef source(int width, int height, bool gray = false) {
+        NodeRef node = makeNode(Op::Source, {}, {}, width, height);
+        node->gray = gray;
+        node->evaluated = true;
+        return node;
+    }
+    // Supplies the pixels of `node`'s frame on demand: read(rect) returns those inside `rect`, or an
+    // empty image if they cannot be read. Only evaluateRegion() may read a source supplied this way.
+    void provide(const NodeRef& node, std::function<Image(const Rect&)> read) {
+        node->read = std::move(read);
+    }
+    NodeRef resample(const NodeRef& in, float compressionScale, bool inverseColors, ResampleFilter filter = ResampleFilter::Area) {
+        return resize(in, int(in->width / compressionScale), int(in->height / compressionScale), filter, inverseColors);
+    }
+    NodeRef resize(const NodeRef& in, int width, int height, ResampleFilter filter = ResampleFilter::Area, bool inverseColors = false) {
+        NodeRef node = makeNode(Op::Resample, {in}, {1.0 * width, 1.0 * height, 1.0 * static_cast<int>(filter), inverseColors ? 1.0 : 0.0},
+                                std::max(0, width), std::max(0, height));
+        if (node->rowTable.dstSize != node->height || node->colTable.dstSize != node->width) {
+            node->rowTable = ResampleTable::build(in->height, node->height, filter);
+            node->colTable = ResampleTable::build(in->width, node->width, filter);
+        }
+        return node;
+    }
+    NodeRef colorMatrix(const NodeRef& in, const ColorMatrix& matrix) {
+        std::vector<double> params;
+        for (int out = 0; out < 3; out++) {
+            for (int c = 0; c < 3; c++) {
+                params.push_back(matrix.m[out][c]);
+            }
+            params.push_back(matrix.offset[out]);
+        }
+        return makeNode(Op::ColorMatrix, {in}, params, in->width, in->height);
+    }
+    NodeRef sepia(const NodeRef& in) {
+        return colorMatrix(in, ColorMatrix::sepia());
+    }
+    // A point operation straight on top of another reads that one's input through the composed table,
+    // so a run of them costs one pass over the pixels. `in` is left in the graph untouched, as the
+    // caller may still evaluate it; compose the tables first to avoid creating it at all.
+    NodeRef pointLUT(const NodeRef& in, const ChannelLUT& lut) {
+        if (in->op == Op::PointLUT) {
+            return pointLUT(in->inputs[0], lutOf(in->params).then(lut));
+        }
+        std::vector<double> params;
+        for (int c = 0; c < 3; c++) {
+            params.insert(params.end(), lut.table[c], lut.table[c] + 256);
+        }
+        return makeNode(Op::PointLUT, {in}, params, in->width, in->height);
+    }
+    NodeRef blur(const NodeRef& in, float sigma = DEFAULT_BLUR_SIGMA, EdgeMode edge = EdgeMode::Clamp) {
+        return makeNode(Op::Blur, {in}, {sigma, edge == EdgeMode::Mirror ? 1.0 : 0.0}, in->width, in->height);
+    }
+    NodeRef contour(const NodeRef& in, int diffToleration, int skipRadius, EdgeOperator edgeOperator = EdgeOperator::MaxChannelDifference) {
+        return makeNode(Op::Contour, {in}, {1.0 * diffToleration, 1.0 * skipRadius, 1.0 * static_cast<int>(edgeOperator)}, in->width, in->height);
+    }
+    NodeRef lines(const NodeRef& in, int maxBlankStreak, int lineLengthMinimum, int skipRadius) {
+        NodeRef contoured = contour(in, LINE_CONTOUR_TOLERANCE, LINE_CONTOUR_SKIP_RADIUS);
+        return makeNode(Op::Lines, {in, contoured}, {1.0 * maxBlankStreak, 1.0 * lineLengthMinimum, 1.0 * skipRadius}, in->width, in->height);
+    }
+    NodeRef shape(const NodeRef& in, int diffToleration, const int shapeOrigin[2]) {
+        return makeNode(Op::Shape, {in}, {1.0 * diffToleration, 1.0 * shapeOrigin[0], 1.0 * shapeOrigin[1]}, in->width, in->height);
+    }
+
+    // Computes `node` (and whatever it depends on that is not computed yet) and returns its pixels,
+    // which stay valid for the lifetime of the pipeline. Contour maps travel between nodes as
+    // bitmasks and are only drawn as BGR pixels here, when someone asks for them.
+    ImageView evaluate(const NodeRef& node) {
+        compute(node);
+        if (node->op == Op::Contour && node->result.empty() && node->width > 0 && node->height > 0) {
+            node->result = maskImageBMP(node->mask);
+            if (cache_) {
+                cache_->store(keyOf(*node), node->result);
+            }
+            if (lowMemory_ && node->consumed >= node->consumers) {
+                node->mask = Bitmask();
+            }
+        }
+        else if (node->gray && node->result.empty()) {
+            node->result = convertBMP<BGR24>(grayOf(node));
+        }
+        return node->op == Op::Source && !node->gray ? node->source : node->result.view();
+    }
+
+    // Computes grey `node` and returns its pixels, valid for the lifetime of the pipeline.
+    GrayView grayOf(const NodeRef& node) {
+        compute(node);
+        return node->op == Op::Source ? node->graySource : node->grayResult.view();
+    }
+
+    // Like output(), for a grey node: its pixels, or for a contour its map drawn in Gray8.
+    GrayImage outputGray(const NodeRef& node) {
+        if (node->op == Op::Contour) {
+            return maskImageBMP<Gray8>(mask(node));
+        }
+        GrayView pixels = grayOf(node);
+        return node->op == Op::Source ? GrayImage(pixels) : node->grayResult.alias();
+    }
+
+    // Computes contour `node` and returns its edges as a bitmask, without drawing them as pixels.
+    Bitmask mask(const NodeRef& node) {
+        Bitmask edges = edgesOf(node);
+        if (lowMemory_ && node->consumed >= node->consumers) {
+            node->mask = Bitmask();
+            node->evaluated = false;
+        }
+        return edges;
+    }
+
+    // Results are looked up in and added to `cache` (null: no caching). Defaults to resultCache().
+    void setCache(ResultCache* cache) {
+        cache_ = cache;
+    }
+
+    // With `lowMemory` an intermediate result is let go as soon as the last node reading it has been
+    // computed, rather than kept for the pipeline's lifetime. Asking for it again afterwards computes
+    // it again, so outputs should be taken before the nodes built on them.
+    void setLowMemory(bool lowMemory) {
+        lowMemory_ = lowMemory;
+    }
+
+    // Evaluates `node` and returns a handle on its pixels that outlives the pipeline, without copying
+    // (sources, whose pixels the pipeline does not own, are copied).
+    Image output(const NodeRef& node) {
+        ImageView pixels = evaluate(node);
+        return node->op == Op::Source ? Image(pixels) : node->result.alias();
+    }
+
+    // The rectangle of the source that evaluateRegion(node, rect) reads, before any widening of a
+    // contour's window (see contourEdges).
+    Rect sourceRegion(const NodeRef& node, Rect rect) {
+        rect = rect.clipped(node->width, node->height);
+        if (rect.empty() || node->op == Op::Source) {
+            return rect;
+        }
+        std::vector<Rect> reads = inputRegions(*node, rect);
+        Rect region;
+        for (size_t i = 0; i < reads.size(); i++) {
+            region = region.united(sourceRegion(node->inputs[i], reads[i]));
+        }
+        return region;
+    }
+
+    // Computes only `rect` of `node` (clipped to it), as its own image. Each stage computes just the
+    // input its part needs: the rectangle grown by the stage's halo, or mapped back through a
+    // resample, down to the source, so the cost follows the rectangle and not the frame. Point
+    // operations, blurs and resampling give exactly the pixels of a full evaluation, and so do
+    // contours unless thinning still differs at the whole-frame window contourEdges() stops at
+    // (see there). Lines and shapes are only searched for within lineHalo() of the rectangle and
+    // inside it. Nothing is cached.
+    Image evaluateRegion(const NodeRef& node, Rect rect) {
+        return regionOf(node, rect, nullptr);
+    }
+
+    // evaluateRegion() for several outputs of the same rectangle. Every node more than one of them
+    // reads is computed once, over the union of the windows its readers need, and each reader crops
+    // its own window from that.
+    std::vector<Image> evaluateRegions(const std::vector<NodeRef>& outputs, const Rect& rect) {
+        RegionPlan plan;
+        for (const NodeRef& output : outputs) {
+            plan.demand(output.get(), rect.clipped(output->width, output->height));
+        }
+        // Consumers come after their inputs in nodes_, so walking it backwards settles each node's
+        // window before passing it on.
+        for (auto it = nodes_.rbegin(); it != nodes_.rend(); ++it) {
+            const Node& node = **it;
+            auto planned = plan.entries.find(&node);
+            if (planned == plan.entries.end() || planned->second.rect.empty() || node.op == Op::Source) {
+                continue;
+            }
+            std::vector<Rect> reads = inputRegions(node, planned->second.rect);
+            for (size_t i = 0; i < reads.size(); i++) {
+                plan.demand(node.inputs[i].get(), reads[i]);
+            }
+        }
+        std::vector<Image> regions;
+        for (const NodeRef& output : outputs) {
+            regions.push_back(regionOf(output, rect, &plan));
+        }
+        return regions;
+    }
+
+    // Evaluates `node` and moves its pixels out of the pipeline.
+    Image take(const NodeRef& node) {
+        ImageView pixels = evaluate(node);
+        if (node->op == Op::Source) {
+            return Image(pixels);
+        }
+        node->evaluated = false;
+        return std::move(node->result);
+    }
+
+private:
+    void compute(const NodeRef& node) {
+        if (node->evaluated || loadCached(node)) {
+            return;
+        }
+        if (node->gray && node->op != Op::Contour) {
+            evaluateGray(node);
+        }
+        else if (isFusable(node->op)) {
+            evaluateChain(node);
+        }
+        else {
+            evaluateBarrier(node);
+        }
+        node->evaluated = true;
+        if (cache_ && node->op != Op::Contour && !node->gray) {
+            cache_->store(keyOf(*node), node->result);
+        }
+    }
+
+    // The edges of a contour node; a map loaded from the cache is converted back from its pixels.
+    const Bitmask& edgesOf(const NodeRef& node) {
+        compute(node);
+        if (node->mask.width() != node->width || node->mask.height() != node->height) {
+            node->mask = contourImageMask(node->result);
+        }
+        return node->mask;
+    }
+
+    static bool isFusable(Op op) {
+        return op == Op::Resample || op == Op::ColorMatrix || op == Op::Blur || op == Op::PointLUT;
+    }
+
+    uint64_t keyOf(Node& node) {
+        if (!node.keyed) {
+            if (node.op == Op::Source) {
+                node.key = node.gray ? hashPixels(node.graySource) : hashPixels(node.source);
+            }
+            else {
+                std::vector<uint64_t> parts = { static_cast<uint64_t>(node.op), static_cast<uint64_t>(node.width), static_cast<uint64_t>(node.height) };
+                for (const NodeRef& input : node.inputs) {
+                    parts.push_back(keyOf(*input));
+                }
+                node.key = hashBytes(parts.data(), parts.size() * sizeof(uint64_t), hashBytes(node.params.data(), node.params.size() * sizeof(double)));
+            }
+            node.keyed = true;
+        }
+        return node.key;
+    }
+
+    bool loadCached(const NodeRef& node) {
+        // The cache holds BGR pixels; of the grey nodes only contours, which are drawn in BGR, use it.
+        if (!cache_ || node->op == Op::Source || (node->gray && node->op != Op::Contour) || !cache_->load(keyOf(*node), node->result)) {
+            return false;
+        }
+        node->evaluated = true;
+        return true;
+    }
+
+    static const char* opName(Op op) {
+        switch (op) {
+        case Op::Source: return "source";
+        case Op::Resample: return "resample";
+        case Op::ColorMatrix: return "colorMatrix";
+        case Op::PointLUT: return "lut";
+        case Op::Blur: return "blur";
+        case Op::Contour: return "contour";
+        case Op::Lines: return "lines";
+        case Op::Shape: return "shape";
+        }
+        return "unknown";
+    }
+
+    static int halo(const Node& node) {
+        return node.op == Op::Blur ? blurHalo(node.params[0]) : 0;
+    }
+
+    static int contourHalo(const Node& node) {
+        return contourRegionHalo(int(node.params[1]));
+    }
+
+    // How far around its rectangle a regional line search looks for supporting edges.
+    static int lineHalo(const Node& node) {
+        return int(node.params[0]) + int(node.params[1]);
+    }
+
+    static ColorMatrix matrixOf(const std::vector<double>& p) {
+        ColorMatrix matrix;
+        for (int c = 0; c < 3; c++) {
+            for (int k = 0; k < 3; k++) {
+                matrix.m[c][k] = static_cast<int16_t>(p[c * 4 + k]);
+            }
+            matrix.offset[c] = static_cast<int32_t>(p[c * 4 + 3]);
+        }
+        return matrix;
+    }
+
+    static ChannelLUT lutOf(const std::vector<double>& p) {
+        ChannelLUT lut;
+        for (int c = 0; c < 3; c++) {
+            for (int v = 0; v < 256; v++) {
+                lut.table[c][v] = static_cast<uint8_t>(p[c * 256 + v]);
+            }
+        }
+        return lut;
+    }
+
+    // The input rectangle a resample reads for output rectangle `rect`.
+    static Rect resampleSource(const ResampleTable& rowTable, const ResampleTable& colTable, const Rect& rect) {
+        int rowFirst, rowLast, colFirst, colLast;
+        rowTable.sourceSpan(rect.row, rect.row + rect.rows, rowFirst, rowLast);
+        colTable.sourceSpan(rect.col, rect.col + rect.cols, colFirst, colLast);
+        return { rowFirst, colFirst, rowLast - rowFirst + 1, colLast - colFirst + 1 };
+    }
+
+    // Windows of each node that an evaluateRegions() call needs, and the results of those read more
+    // than once.
+    struct RegionPlan {
+        struct Entry {
+            Rect rect;
+            int readers = 0;
+            Image pixels;
+            Bitmask mask;  // Contour nodes
+        };
+        std::map<const Node*, Entry> entries;
+
+        void demand(const Node* node, const Rect& rect) {
+            Entry& entry = entries[node];
+            entry.rect = entry.rect.united(rect);
+            entry.readers++;
+        }
+        // The shared window of `node` when it holds `rect`, else nullptr.
+        Entry* shared(const Node* node, const Rect& rect) {
+            auto it = entries.find(node);
+            return it != entries.end() && it->second.readers > 1 && it->second.rect.contains(rect) ? &it->second : nullptr;
+        }
+    };
+
+    // The rectangle of each input that computing `rect` of `node` reads.
+    std::vector<Rect> inputRegions(const Node& node, const Rect& rect) {
+        const NodeRef& input = node.inputs[0];
+        switch (node.op) {
+        case Op::Resample:
+            return { resampleSource(node.rowTable, node.colTable, rect) };
+        case Op::Blur:
+            return { rect.expanded(halo(node)).clipped(input->width, input->height) };
+        case Op::Contour:
+            return { rect.expanded(contourHalo(node)).clipped(input->width, input->height) };
+        case Op::Lines:
+            return { rect, rect.expanded(lineHalo(node)).clipped(node.width, node.height) };
+        default:
+            return { rect };
+        }
+    }
+
+    Image regionOf(const NodeRef& node, Rect rect, RegionPlan* plan) {
+        rect = rect.clipped(node->width, node->height);
+        if (rect.empty()) {
+            return Image(rect.cols, rect.rows);
+        }
+        if (node->op == Op::Contour) {
+            return maskImageBMP(regionEdges(node, rect, plan));
+        }
+        RegionPlan::Entry* shared = plan ? plan->shared(node.get(), rect) : nullptr;
+        if (!shared) {
+            return computeRegion(node, rect, plan);
+        }
+        if (shared->pixels.empty()) {
+            shared->pixels = computeRegion(node, shared->rect, plan);
+        }
+        return Image(shared->pixels.sub(rect.row - shared->rect.row, rect.col - shared->rect.col, rect.rows, rect.cols));
+    }
+
+    Image computeRegion(const NodeRef& node, const Rect& rect, RegionPlan* plan) {
+        const NodeRef& input = node->inputs.empty() ? node : node->inputs[0];
+        const std::vector<double>& p = node->params;
+        BMP_TRACE_SCOPE_DETAIL(opName(node->op), std::to_string(rect.cols) + "x" + std::to_string(rect.rows) + " region");
+        switch (node->op) {
+        case Op::Source: {
+            Image pixels = node->read ? node->read(rect) : Image(node->source.sub(rect.row, rect.col, rect.rows, rect.cols));
+            if (pixels.width() != rect.cols || pixels.height() != rect.rows) {
+                std::cerr << "Region needs source pixels that could not be read" << std::endl;
+                return Image(rect.cols, rect.rows);
+            }
+            return pixels;
+        }
+        case Op::Resample: {
+            Rect need = resampleSource(node->rowTable, node->colTable, rect);
+            Image in = regionOf(input, need, plan);
+            Image out(rect.cols, rect.rows);
+            resampleRowsBMP(in.view(), 0, out.view(), 0, node->rowTable.window(rect.row, rect.rows, need.row), node->colTable.window(rect.col, rect.cols, need.col));
+            if (p[3] != 0) {
+                inverseColorsBMP(out);
+            }
+            return out;
+        }
+        case Op::ColorMatrix: {
+            Image img = regionOf(input, rect, plan);
+            colorMatrixBMP(img, matrixOf(p));
+            return img;
+        }
+        case Op::PointLUT: {
+            Image img = regionOf(input, rect, plan);
+            channelLUTBMP(img, lutOf(p));
+            return img;
+        }
+        case Op::Blur: {
+            Rect need = rect.expanded(halo(*node)).clipped(input->width, input->height);
+            Image img = regionOf(input, need, plan);
+            blurBMP(img.view(), p[0], p[1] != 0 ? EdgeMode::Mirror : EdgeMode::Clamp);
+            return Image(img.sub(rect.row - need.row, rect.col - need.col, rect.rows, rect.cols));
+        }
+        case Op::Lines: {
+            Rect search = rect.expanded(lineHalo(*node)).clipped(node->width, node->height);
+            std::vector<LineSegment> segments = detectLinesBMP(regionEdges(node->inputs[1], search, plan), int(p[0]), int(p[1]), int(p[2]));
+            for (LineSegment& segment : segments) {
+                segment.x0 += search.row - rect.row;
+                segment.x1 += search.row - rect.row;
+                segment.y0 += search.col - rect.col;
+                segment.y1 += search.col - rect.col;
+            }
+            Image img = regionOf(input, rect, plan);
+            drawLinesBMP(img, segments);
+            return img;
+        }
+        case Op::Shape: {
+            int origin[2] = { int(p[1]) - rect.row, int(p[2]) - rect.col };
+            return shapeDetectorBMP(regionOf(input, rect, plan).view(), int(p[0]), origin);
+        }
+        default:
+            return Image();
+        }
+    }
+
+    // The edges of contour `node` inside `rect`, from the plan's shared map when there is one.
+    Bitmask regionEdges(const NodeRef& node, const Rect& rect, RegionPlan* plan) {
+        RegionPlan::Entry* shared = plan ? plan->shared(node.get(), rect) : nullptr;
+        if (!shared) {
+            return contourEdges(node, rect, plan);
+        }
+        if (shared->mask.width() == 0) {
+            shared->mask = contourEdges(node, shared->rect, plan);
+        }
+        return cropMask(shared->mask, { rect.row - shared->rect.row, rect.col - shared->rect.col, rect.rows, rect.cols });
+    }
+
+    // The edges of contour `node` inside `rect`. Thinning is greedy in scan order, so whether a pixel
+    // is kept can depend on edges any distance above it or to its side: the window starts at
+    // contourHalo() and doubles until suppressEdgesInside() finds all it depends on, which it always
+    // does once the window is the whole frame.
+    Bitmask contourEdges(const NodeRef& node, const Rect& rect, RegionPlan* plan) {
+        const NodeRef& input = node->inputs[0];
+        const std::vector<double>& p = node->params;
+        int skipRadius = int(p[1]);
+        int edgeHalo = contourRegionHalo(0);
+        BMP_TRACE_SCOPE_DETAIL(opName(node->op), std::to_string(rect.cols) + "x" + std::to_string(rect.rows) + " region");
+        for (int reach = contourHalo(*node) - edgeHalo; ; reach *= 2) {
+            Rect window = rect.expanded(reach).clipped(input->width, input->height);
+            Rect need = window.expanded(edgeHalo).clipped(input->width, input->height);
+            Image in = regionOf(input, need, plan);
+            Bitmask edges = cropMask(blurredEdgeMaskBMP(in.view(), int(p[0]), static_cast<EdgeOperator>(int(p[2]))),
+                                     { window.row - need.row, window.col - need.col, window.rows, window.cols });
+            Rect inside = { rect.row - window.row, rect.col - window.col, rect.rows, rect.cols };
+            if (skipRadius <= 0) {
+                return cropMask(edges, inside);
+            }
+            Bitmask kept;
+            if (suppressEdgesInside(edges, skipRadius, inside, window.row > 0, window.col > 0, window.col + window.cols < input->width, kept)) {
+                return cropMask(kept, inside);
+            }
+        }
+    }
+
+    static Bitmask cropMask(const Bitmask& mask, const Rect& rect) {
+        Bitmask part(rect.cols, rect.rows);
+        for (int x = 0; x < rect.rows; x++) {
+            for (int y = 0; y < rect.cols; y++) {
+                if (mask.test(x + rect.row, y + rect.col)) {
+                    part.set(x, y);
+                }
+            }
+        }
+        return part;
+    }
+
+    NodeRef makeNode(Op op, std::vector<NodeRef> inputs, std::vector<double> params, int width, int height) {
+        for (const NodeRef& existing : nodes_) {
+            if (op != Op::Source && existing->op == op && existing->inputs == inputs && existing->params == params) {
+                return existing;
+            }
+        }
+        NodeRef node = std::make_shared<Node>();
+        node->op = op;
+        node->inputs = std::move(inputs);
+        node->params = std::move(params);
+        node->width = width;
+        node->height = height;
+        for (const NodeRef& input : node->inputs) {
+            input->consumers++;
+        }
+        node->gray = !node->inputs.empty() && node->inputs[0]->gray && keepsGray(op, node->params);
+        nodes_.push_back(node);
+        return node;
+    }
+
+    static bool keepsGray(Op op, const std::vector<double>& params) {
+        switch (op) {
+        case Op::Resample:
+        case Op::Blur:
+        case Op::Contour:
+        case Op::Shape:
+            return true;
+        case Op::PointLUT:
+            return lutOf(params).isUniform();
+        default:
+            return false;
+        }
+    }
+
+    // Grey nodes other than contours, one whole-frame pass each. Inverting a resample is the
+    // brightening inverseColorsBMP gives a pixel whose channels are equal.
+    void evaluateGray(const NodeRef& node) {
+        const NodeRef& input = node->inputs[0];
+        GrayView in = grayOf(input);
+        const std::vector<double>& p = node->params;
+        BMP_TRACE_SCOPE_DETAIL(opName(node->op), std::to_string(in.width) + "x" + std::to_string(in.height) + " gray");
+        switch (node->op) {
+        case Op::Resample:
+            node->grayResult = GrayImage(node->width, node->height);
+            resampleRowsBMP(in, 0, node->grayResult.view(), 0, node->rowTable, node->colTable);
+            if (p[3] != 0) {
+                channelLUTBMP(node->grayResult.view(), ChannelLUT::brightness(10));
+            }
+            break;
+        case Op::PointLUT:
+        case Op::Blur:
+            node->grayResult = reclaimGray(input);
+            if (node->grayResult.empty()) {
+                node->grayResult = GrayImage(in);
+            }
+            if (node->op == Op::PointLUT) {
+                channelLUTBMP(node->grayResult.view(), lutOf(p));
+            }
+            else {
+                blurBMP(node->grayResult.view(), p[0], p[1] != 0 ? EdgeMode::Mirror : EdgeMode::Clamp);
+            }
+            break;
+        case Op::Shape: {
+            int origin[2] = { int(p[1]), int(p[2]) };
+            node->grayResult = shapeDetectorBMP(in, int(p[0]), origin);
+            break;
+        }
+        default:
+            break;
+        }
+        consume(input);
+    }
+
+    void evaluateBarrier(const NodeRef& node) {
+        const NodeRef& input = node->inputs[0];
+        const std::vector<double>& p = node->params;
+        BMP_TRACE_SCOPE_DETAIL(opName(node->op), std::to_string(input->width) + "x" + std::to_string(input->height));
+        switch (node->op) {
+        case Op::Contour:
+            if (input->gray) {
+                node->mask = contourMaskBMP(grayOf(input), int(p[0]), int(p[1]), static_cast<EdgeOperator>(int(p[2])));
+            }
+            else {
+                node->mask = contourMaskBMP(evaluate(input), int(p[0]), int(p[1]), static_cast<EdgeOperator>(int(p[2])));
+            }
+            break;
+        case Op::Lines: {
+            ImageView in = evaluate(input);
+            const Bitmask& edges = edgesOf(node->inputs[1]);
+            node->result = reclaim(node->inputs[0]);
+            if (node->result.empty()) {
+                node->result = Image(in);
+            }
+            drawLinesBMP(node->result, detectLinesBMP(edges, int(p[0]), int(p[1]), int(p[2])));
+            break;
+        }
+        case Op::Shape: {
+            int origin[2] = { int(p[1]), int(p[2]) };
+            node->result = shapeDetectorBMP(evaluate(input), int(p[0]), origin);
+            break;
+        }
+        default:
+            break;
+        }
+        for (const NodeRef& read : node->inputs) {
+            consume(read);
+        }
+    }
+
+    // In low-memory mode, the pixels of `input` for its last consumer to overwrite, if nothing else
+    // holds them; otherwise an empty image.
+    Image reclaim(const NodeRef& input) {
+        if (!lowMemory_ || input->op == Op::Source || input->consumed + 1 < input->consumers || input->result.aliased()) {
+            return Image();
+        }
+        return std::move(input->result);
+    }
+    GrayImage reclaimGray(const NodeRef& input) {
+        if (!lowMemory_ || input->op == Op::Source || input->consumed + 1 < input->consumers || input->grayResult.aliased()) {
+            return GrayImage();
+        }
+        return std::move(input->grayResult);
+    }
+
+    // Counts one more computed consumer of `input`, and in low-memory mode drops its pixels once
+    // there are none left to come. Sources belong to the caller; only a grey source's BGR copy goes.
+    void consume(const NodeRef& input) {
+        input->consumed++;
+        if (!lowMemory_ || input->consumed < input->consumers) {
+            return;
+        }
+        input->result = Image();
+        if (input->op != Op::Source) {
+            input->grayResult = GrayImage();
+            input->mask = Bitmask();
+            input->evaluated = false;
+        }
+    }
+
+    // Collects the longest run of fusable nodes ending at `node` whose intermediates nobody else
+    // needs, then produces `node` band by band: each band is generated from the chain's input with
+    // enough extra rows for every blur in the chain, pushed through all stages while cache-resident,
+    // and only its final rows are written out. Bands run in parallel and never overlap in output.
+    void evaluateChain(const NodeRef& node) {
+        std::vector<Node*> chain;
+        NodeRef head = node;
+        while (true) {
+            chain.push_back(head.get());
+            const NodeRef& input = head->inputs[0];
+            if (head->op == Op::Resample || !isFusable(input->op) || input->gray || input->consumers > 1 || input->evaluated || loadCached(input)) {
+                break;
+            }
+            head = input;
+        }
+        std::reverse(chain.begin(), chain.end());
+        ImageView in = evaluate(head->inputs[0]);
+#ifdef BMP_TRACE
+        std::string stages;
+        for (Node* stage : chain) {
+            stages += (stages.empty() ? "" : "+") + std::string(opName(stage->op));
+        }
+        BMP_TRACE_SCOPE(stages);
+#endif
+
+        int totalHalo = 0;
+        for (Node* stage : chain) {
+            totalHalo += halo(*stage);
+        }
+        int width = node->width, height = node->height;
+        const NodeRef& input = head->inputs[0];
+        bool inPlace = false;
+        if (totalHalo == 0 && chain[0]->op != Op::Resample) {
+            node->result = reclaim(input);
+            inPlace = !node->result.empty();
+        }
+        if (!inPlace) {
+            node->result = Image(width, height);
+        }
+        ImageView out = node->result.view();
+        if (width <= 0 || height <= 0) {
+            return;
+        }
+
+        const ResampleTable& rowTable = chain[0]->rowTable;
+        const ResampleTable& colTable = chain[0]->colTable;
+
+        // Bands of roughly 256 KB, and tall enough that the halo rows are not the bulk of the work.
+        const size_t bandBytes = 256 * 1024;
+        int bandRows = std::max<int>({ 8, 4 * totalHalo, static_cast<int>(bandBytes / (static_cast<size_t>(width) * sizeof(RGBTRIPLE))) });
+        int bands = (height + bandRows - 1) / bandRows;
+        threadPool().parallelFor(bands, [&](int band) {
+            ThreadPool::InlineScope inlineKernels;
+            int first = band * bandRows;
+            int last = std::min(height, first + bandRows);
+            int needFirst = std::max(0, first - totalHalo);
+            int needLast = std::min(height, last + totalHalo);
+
+            thread_local Image scratch;
+            ImageView work = out.sub(first, 0, last - first, width);
+            if (totalHalo > 0) {
+                if (scratch.width() != width || scratch.height() < needLast - needFirst) {
+                    scratch = Image(width, needLast - needFirst);
+                }
+                work = scratch.sub(0, 0, needLast - needFirst, width);
+            }
+            int workFirst = totalHalo > 0 ? needFirst : first;
+
+            if (chain[0]->op == Op::Resample) {
+                resampleRowsBMP(in, 0, work, workFirst, rowTable, colTable);
+                if (chain[0]->params[3] != 0) {
+                    inverseColorsBMP(work);
+                }
+            }
+            else if (!inPlace) {
+                for (int row = 0; row < work.height; row++) {
+                    std::memcpy(work[row], in[workFirst + row], width * sizeof(RGBTRIPLE));
+                }
+            }
+            for (Node* stage : chain) {
+                const std::vector<double>& p = stage->params;
+                if (stage->op == Op::Blur) {
+                    blurBMP(work, p[0], p[1] != 0 ? EdgeMode::Mirror : EdgeMode::Clamp);
+                }
+                else if (stage->op == Op::ColorMatrix) {
+                    colorMatrixBMP(work, matrixOf(p));
+                }
+                else if (stage->op == Op::PointLUT) {
+                    channelLUTBMP(work, lutOf(p));
+                }
+            }
+
+            if (totalHalo > 0) {
+                for (int row = first; row < last; row++) {
+                    std::memcpy(out[row], work[row - needFirst], width * sizeof(RGBTRIPLE));
+                }
+            }
+        });
+        consume(input);
+    }
+
+    std::vector<NodeRef> nodes_;
+    ResultCache* cache_ = resultCache();
+    bool lowMemory_ = false;
+};
+
+Image compressBMP(const ImageView& img, float compressionScale, bool inverseColors, bool blur, bool sepia, float blurSigma = DEFAULT_BLUR_SIGMA, EdgeMode blurEdge = EdgeMode::Clamp, ResampleFilter filter = ResampleFilter::Area) {
+    int new_width = int(img.width / compressionScale);
+    int new_height = int(img.height / compressionScale);
+    std::cout << new_width << " : " << new_height << std::endl;
+    Pipeline pipeline;
+    Pipeline::NodeRef node = pipeline.resample(pipeline.source(img), compressionScale, inverseColors, filter);
+    if (blur) {
+        node = pipeline.blur(node, blurSigma, blurEdge);
+    }
+    if (sepia) {
+        node = pipeline.sepia(node);
+    }
+    return pipeline.take(node);
+}
+
+// 8-bit files get a grey-ramp colour table, so their pixels read back as Gray8.
+void writeBMPHeader(std::ostream& file, int width, int height, int bitCount = 24) {
+    size_t rowBytes = bmpRowBytes(width, bitCount);
+    size_t paletteBytes = bitCount == 8 ? 256 * sizeof(RGBQUAD) : 0;
+
+    BITMAPFILEHEADER fileHeader;
+    BITMAPINFOHEADER infoHeader;
+
+    fileHeader.bfType = 0x4D42;
+    fileHeader.bfSize = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + paletteBytes + rowBytes * height;
+    fileHeader.bfReserved1 = 0;
+    fileHeader.bfReserved2 = 0;
+    fileHeader.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + paletteBytes;
+
+    infoHeader.biSize = sizeof(BITMAPINFOHEADER);
+    infoHeader.biWidth = width;
+    infoHeader.biHeight = height;
+    infoHeader.biPlanes = 1;
+    infoHeader.biBitCount = bitCount;
+    infoHeader.biCompression = 0;
+    infoHeader.biSizeImage = rowBytes * height;
+    infoHeader.biXPelsPerMeter = 0;
+    infoHeader.biYPelsPerMeter = 0;
+    infoHeader.biClrUsed = bitCount == 8 ? 256 : 0;
+    infoHeader.biClrImportant = 0;
+
+    file.write(reinterpret_cast<char*>(&fileHeader), sizeof(fileHeader));
+    file.write(reinterpret_cast<char*>(&infoHeader), sizeof(infoHeader));
+    for (int i = 0; i < 256 && bitCount == 8; i++) {
+        RGBQUAD entry = { uint8_t(i), uint8_t(i), uint8_t(i), 0 };
+        file.write(reinterpret_cast<char*>(&entry), sizeof(entry));
+    }
+}
+
+// Appends `pixels` as padded BMP rows, starting at its row 0.
+template <typename Format>
+void writeBMPRows(std::ostream& file, const BasicImageView<Format>& pixels) {
+    int height = pixels.height;
+    int width = pixels.width;
+    size_t rowBytes = bmpRowBytes(width, Format::bitCount);
+    if (height <= 0) {
+        return;
+    }
+
+    // Rows already laid out as on disk (e.g. an untouched mapped input) go out in a single write.
+    if (pixels.stride == static_cast<ptrdiff_t>(rowBytes)) {
+        file.write(reinterpret_cast<const char*>(pixels[0]), rowBytes * height);
+        BMP_TRACE_COUNTER(wrote, rowBytes * height);
+        return;
+    }
+
+    // Otherwise pack padded rows into ~1 MB chunks so the stream sees a handful of large writes.
+    const size_t chunkBytes = 1 << 20;
+    int rowsPerChunk = std::max<size_t>(1, chunkBytes / rowBytes);
+    thread_local std::vector<char> chunk;
+    chunk.assign(rowBytes * std::min(rowsPerChunk, height), 0);
+    for (int first = 0; first < height; first += rowsPerChunk) {
+        int rows = std::min(rowsPerChunk, height - first);
+        for (int i = 0; i < rows; i++) {
+            std::memcpy(chunk.data() + i * rowBytes, pixels[first + i], width * sizeof(typename Format::Pixel));
+        }
+        file.write(chunk.data(), rows * rowBytes);
+        BMP_TRACE_COUNTER(wrote, rows * rowBytes);
+    }
+}
+
+// Writes a BMP of the pixels' own format: 24-bit for BGR24, 8-bit grey for Gray8.
+template <typename Format>
+void saveBMP(std::ostream& file, const BasicImageView<Format>& pixels) {
+    BMP_TRACE_SCOPE_DETAIL("encode", std::to_string(pixels.width) + "x" + std::to_string(pixels.height));
+    writeBMPHeader(file, pixels.width, pixels.height, Format::bitCount);
+    writeBMPRows(file, pixels);
+}
+
+template <typename Format>
+void saveBMP(std::ostream& file, const BasicImage<Format>& pixels) {
+    saveBMP(file, pixels.view());
+}
+
+template <typename Format>
+bool saveBMPFile(const std::string& path, const BasicImageView<Format>& pixels) {
+    std::ofstream ofile(path, std::ios::binary);
+    if (!ofile) {
+        std::cerr << "Unable to open output file " << path << std::endl;
+        return false;
+    }
+    saveBMP(ofile, pixels);
+    return static_cast<bool>(ofile);
+}
+
+// Writes `mask` as the same file saveBMP(maskImageBMP<Format>(mask)) gives, expanding the bits a
+// chunk of rows at a time instead of drawing the whole image first.
+template <typename Format = BGR24>
+void saveMaskBMP(std::ostream& file, const Bitmask& mask) {
+    const int pixelBytes = sizeof(typename Format::Pixel);
+    int height = mask.height();
+    int width = mask.width();
+    BMP_TRACE_SCOPE_DETAIL("encode", std::to_string(width) + "x" + std::to_string(height) + " mask");
+    writeBMPHeader(file, width, height, Format::bitCount);
+    size_t rowBytes = bmpRowBytes(width, Format::bitCount);
+    if (height <= 0) {
+        return;
+    }
+    const size_t chunkBytes = 1 << 20;
+    int rowsPerChunk = std::max<size_t>(1, chunkBytes / rowBytes);
+    std::vector<char> chunk(rowBytes * std::min(rowsPerChunk, height));
+    for (int first = 0; first < height; first += rowsPerChunk) {
+        int rows = std::min(rowsPerChunk, height - first);
+        for (int i = 0; i < rows; i++) {
+            char* bytes = chunk.data() + i * rowBytes;
+            for (int y = 0; y < width; y++) {
+                std::memset(bytes + pixelBytes * y, mask.test(first + i, y) ? 255 : 0, pixelBytes);
+            }
+        }
+        file.write(chunk.data(), rows * rowBytes);
+        BMP_TRACE_COUNTER(wrote, rows * rowBytes);
+    }
+}
+
+template <typename Format = BGR24>
+bool saveMaskBMPFile(const std::string& path, const Bitmask& mask) {
+    std::ofstream ofile(path, std::ios::binary);
+    if (!ofile) {
+        std::cerr << "Unable to open output file " << path << std::endl;
+        return false;
+    }
+    saveMaskBMP<Format>(ofile, mask);
+    return static_cast<bool>(ofile);
+}
+
+// Saves images on a dedicated thread, so encoding and writing overlap whatever is computed next.
+// Images are handed over by move (or as an alias of pixels that no longer change), never copied.
+// enqueue() blocks while `maxPending` images are waiting, which bounds the memory the queue holds.
+class AsyncWriter {
+public:
+    explicit AsyncWriter(size_t maxPending = 8) : maxPending_(std::max<size_t>(1, maxPending)) {
+        thread_ = std::thread([this] { run(); });
+    }
+    ~AsyncWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        changed_.notify_all();
+        thread_.join();
+    }
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+    void enqueue(std::string path, Image pixels) {
+        Job job;
+        job.path = std::move(path);
+        job.kind = Kind::Pixels;
+        job.pixels = std::move(pixels);
+        push(std::move(job));
+    }
+    // Written as an 8-bit grey file.
+    void enqueue(std::string path, GrayImage pixels) {
+        Job job;
+        job.path = std::move(path);
+        job.kind = Kind::GrayPixels;
+        job.grayPixels = std::move(pixels);
+        push(std::move(job));
+    }
+    // Queues a binary map, written as white on black (8-bit if `gray`, else 24-bit); it stays one bit
+    // per pixel until it is encoded.
+    void enqueue(std::string path, Bitmask mask, bool gray = false) {
+        Job job;
+        job.path = std::move(path);
+        job.kind = gray ? Kind::GrayMask : Kind::Mask;
+        job.mask = std::move(mask);
+        push(std::move(job));
+    }
+
+    // Waits until everything enqueued so far is on disk; returns how many writes have failed.
+    int finish() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [&] { return queue_.empty() && !writing_; });
+        return failures_;
+    }
+
+private:
+    enum class Kind { Pixels, GrayPixels, Mask, GrayMask };
+
+    struct Job {
+        std::string path;
+        Kind kind;
+        Image pixels;
+        GrayImage grayPixels;
+        Bitmask mask;
+    };
+
+    void push(Job job) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [&] { return queue_.size() < maxPending_; });
+        queue_.push_back(std::move(job));
+        changed_.notify_all();
+    }
+
+    static bool save(const Job& job) {
+        switch (job.kind) {
+        case Kind::GrayPixels:
+            return saveBMPFile(job.path, job.grayPixels.view());
+        case Kind::Mask:
+            return saveMaskBMPFile(job.path, job.mask);
+        case Kind::GrayMask:
+            return saveMaskBMPFile<Gray8>(job.path, job.mask);
+        default:
+            return saveBMPFile(job.path, job.pixels.view());
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            changed_.wait(lock, [&] { return stop_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            Job job = std::move(queue_.front());
+            queue_.pop_front();
+            writing_ = true;
+            changed_.notify_all();
+            lock.unlock();
+            bool ok = save(job);
+            job = Job();
+            lock.lock();
+            failures_ += ok ? 0 : 1;
+            writing_ = false;
+            changed_.notify_all();
+        }
+    }
+
+    size_t maxPending_;
+    std::deque<Job> queue_;
+    bool writing_ = false;
+    bool stop_ = false;
+    int failures_ = 0;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::thread thread_;
+};
+
+// Runs the compressBMP chain (resample -> invert -> blur -> sepia) over `inputPath` in horizontal
+// strips of `stripHeight` output rows and appends each finished strip to `outputPath`. Only the
+// source rows feeding the current strip and the blur's halo rows are ever resident, so peak memory
+// follows the strip height rather than the image size. Output matches compressBMP exactly.
+// A positive targetWidth/targetHeight overrides the size compressionScale would give that axis.
+bool streamBMP(const std::string& inputPath, const std::string& outputPath, float compressionScale, bool inverseColors, bool blur, bool sepia, int stripHeight, float blurSigma = DEFAULT_BLUR_SIGMA, EdgeMode blurEdge = EdgeMode::Clamp,
+               ResampleFilter filter = ResampleFilter::Area, int targetWidth = 0, int targetHeight = 0) {
+    BMP_TRACE_SCOPE_DETAIL("stream", inputPath);
+    std::ifstream file(inputPath, std::ios::binary);
+    if (!file) {
+        std::cerr << "Unable to open input file" << std::endl;
+        return false;
+    }
+    BMPLayout layout;
+    if (!readBMPLayout(file, layout)) {
+        return false;
+    }
+
+    int new_width = targetWidth > 0 ? targetWidth : int(layout.width / compressionScale);
+    int new_height = targetHeight > 0 ? targetHeight : int(layout.height / compressionScale);
+    std::cout << new_width << " : " << new_height << std::endl;
+    if (new_width <= 0 || new_height <= 0) {
+        std::cerr << "Compression scale leaves no pixels" << std::endl;
+        return false;
+    }
+    ResampleTable rowTable = ResampleTable::build(layout.height, new_height, filter);
+    ResampleTable colTable = ResampleTable::build(layout.width, new_width, filter);
+
+    std::ofstream ofile(outputPath, std::ios::binary);
+    if (!ofile) {
+        std::cerr << "Unable to open output file" << std::endl;
+        return false;
+    }
+    writeBMPHeader(ofile, new_width, new_height);
+
+    stripHeight = std::max(1, stripHeight);
+    const int halo = blur ? blurHalo(blurSigma) : 0;
+    Image window(new_width, stripHeight + 2 * halo);
+    int windowFirst = 0, windowRows = 0;
+    std::vector<uint8_t> sourceRows;
+    Image decodedRows;
+
+    for (int stripFirst = 0; stripFirst < new_height; stripFirst += stripHeight) {
+        BMP_TRACE_SCOPE("strip");
+        int stripLast = std::min(new_height, stripFirst + stripHeight);
+        int needFirst = std::max(0, stripFirst - halo);
+        int needLast = std::min(new_height, stripLast + halo);
+
+        // Keep the halo rows carried over from the previous strip, drop the rest.
+        int carried = std::max(0, windowFirst + windowRows - needFirst);
+        for (int i = 0; i < carried; i++) {
+            std::memmove(window[i], window[needFirst - windowFirst + i], new_width * sizeof(RGBTRIPLE));
+        }
+        windowFirst = needFirst;
+        windowRows = carried;
+
+        int produceFirst = windowFirst + windowRows;
+        if (produceFirst < needLast) {
+            int srcFirst, srcLast;
+            rowTable.sourceSpan(produceFirst, needLast, srcFirst, srcLast);
+            int srcRows = srcLast - srcFirst + 1;
+
+            // The rows are adjacent on disk, so read them in one go and index them through the stride.
+            sourceRows.resize(layout.rowBytes * srcRows);
+            size_t diskFirst = layout.topDown ? layout.height - 1 - srcLast : srcFirst;
+            file.seekg(layout.pixelOffset + diskFirst * layout.rowBytes, std::ios::beg);
+            file.read(reinterpret_cast<char*>(sourceRows.data()), sourceRows.size());
+            if (!file) {
+                std::cerr << "BMP file is truncated" << std::endl;
+                return false;
+            }
+            BMP_TRACE_COUNTER(read, sourceRows.size());
+            ImageView source = { sourceRows.data(), layout.width, srcRows, static_cast<ptrdiff_t>(layout.rowBytes) };
+            if (layout.topDown) {
+                source.data += (srcRows - 1) * layout.rowBytes;
+                source.stride = -source.stride;
+            }
+            if (!isNativeBMPLayout<BGR24>(layout)) {
+                decodedRows = decodeBMPRows<BGR24>(source.data, source.stride, srcRows, layout.width, layout);
+                source = decodedRows.view();
+            }
+
+            ImageView produced = window.sub(windowRows, 0, needLast - produceFirst, new_width);
+            resampleRowsBMP(source, srcFirst, produced, produceFirst, rowTable, colTable);
+            if (inverseColors) {
+                inverseColorsBMP(produced);
+            }
+            windowRows = needLast - windowFirst;
+        }
+
+        Image band(window.sub(0, 0, windowRows, new_width));
+        if (blur) {
+            blurBMP(band.view(), blurSigma, blurEdge);
+        }
+        ImageView strip = band.sub(stripFirst - windowFirst, 0, stripLast - stripFirst, new_width);
+        if (sepia) {
+            sepiaBMP(strip);
+        }
+        writeBMPRows(ofile, strip);
+    }
+    return static_cast<bool>(ofile);
+}
+
+// The choices main() prompts for, applied to every file of a batch.
+struct BatchSpec {
+    float compressionScale = 1;
+    int targetWidth = 0;
+    int targetHeight = 0;
+    ResampleFilter filter = ResampleFilter::Area;
+    bool inverseColors = false;
+    std::vector<ChannelLUT> pointOps;  // in command-line order, right after resizing
+    bool blur = false;
+    bool sepia = false;
+    bool detectShapes = false;
+    int shapeTolerance = 0;
+    int shapeOrigin[2] = { 0, 0 };
+    bool contour = false;
+    int contourTolerance = 0;
+    int contourSkipRadius = 0;
+    EdgeOperator edgeOperator = EdgeOperator::MaxChannelDifference;
+    bool detectLines = false;
+    int maxBlankStreak = 0;
+    int lineLengthMinimum = 0;
+    int lineSkipRadius = 0;
+    bool roi = false;
+    Rect roiRect;  // in output pixels, like shapeOrigin
+    bool lowMemory = false;  // see runBatchCommand
+};
+
+// One requested output: the file name suffix and the node that computes it.
+struct BatchOutput {
+    std::string suffix;
+    Pipeline::NodeRef node;
+};
+
+// A batch input or output: 8-bit grey when the file has a grey colour table, otherwise BGR.
+struct BatchImage {
+    Image pixels;
+    GrayImage gray;
+
+    bool empty() const { return pixels.empty() && gray.empty(); }
+    int width() const { return gray.empty() ? pixels.width() : gray.width(); }
+    int height() const { return gray.empty() ? pixels.height() : gray.height(); }
+};
+
+// A file with a grey colour table is read as Gray8, anything else as BGR.
+BatchImage readBatchImage(const std::string& path) {
+    BMPLayout layout;
+    BatchImage img;
+    if (!readBMPLayout(path, layout)) {
+        return img;
+    }
+    if (layout.bitCount == 8 && layout.grayPalette) {
+        img.gray = readBMPAs<Gray8>(path);
+    }
+    else {
+        img.pixels = readBMP(path);
+    }
+    return img;
+}
+
+// The output of `node` in the format it was computed in.
+BatchImage batchOutput(Pipeline& pipeline, const Pipeline::NodeRef& node) {
+    BatchImage img;
+    if (node->gray) {
+        img.gray = pipeline.outputGray(node);
+    }
+    else {
+        img.pixels = pipeline.output(node);
+    }
+    return img;
+}
+
+// The outputs `spec` asks for, built on `source`; the processed image comes first.
+std::vector<BatchOutput> batchOutputs(Pipeline& pipeline, const Pipeline::NodeRef& source, const BatchSpec& spec) {
+    Pipeline::NodeRef compressed = pipeline.resize(source,
+        spec.targetWidth > 0 ? spec.targetWidth : int(source->width / spec.compressionScale),
+        spec.targetHeight > 0 ? spec.targetHeight : int(source->height / spec.compressionScale), spec.filter, spec.inverseColors);
+    if (!spec.pointOps.empty()) {
+        ChannelLUT lut = spec.pointOps[0];
+        for (size_t i = 1; i < spec.pointOps.size(); i++) {
+            lut = lut.then(spec.pointOps[i]);
+        }
+        compressed = pipeline.pointLUT(compressed, lut);
+    }
+    if (spec.blur) {
+        compressed = pipeline.blur(compressed);
+    }
+    if (spec.sepia) {
+        compressed = pipeline.sepia(compressed);
+    }
+    std::vector<BatchOutput> outputs = { { "-processed.bmp", compressed } };
+    if (spec.detectShapes) {
+        outputs.push_back({ "-shape-processed.bmp", pipeline.shape(compressed, spec.shapeTolerance, spec.shapeOrigin) });
+    }
+    if (spec.contour) {
+        outputs.push_back({ "-contour.bmp", pipeline.contour(compressed, spec.contourTolerance, spec.contourSkipRadius, spec.edgeOperator) });
+    }
+    if (spec.detectLines) {
+        outputs.push_back({ "-line.bmp", pipeline.lines(compressed, spec.maxBlankStreak, spec.lineLengthMinimum, spec.lineSkipRadius) });
+    }
+    return outputs;
+}
+
+// Runs `spec` over `img`, read from `inputPath`, and queues the same outputs as the interactive mode
+// on `writer`, named `outputPrefix` + "-processed.bmp", "-shape-processed.bmp", "-contour.bmp" and
+// "-line.bmp". Each output is queued as soon as it is computed; those computed from a grey input
+// are written as 8-bit files. With a region of interest `img` is not used: only the headers are read
+// up front, the outputs' regions are computed together with Pipeline::evaluateRegions, and only the
+// parts of the file those need are read.
+bool processBatchFile(const std::string& inputPath, const BatchImage& img, const std::string& outputPrefix, const BatchSpec& spec, AsyncWriter& writer) {
+    BMP_TRACE_SCOPE_DETAIL("file", inputPath);
+    int width = img.width(), height = img.height();
+    bool gray = !img.gray.empty();
+    if (spec.roi) {
+        BMPLayout layout;
+        if (!readBMPLayout(inputPath, layout)) {
+            return false;
+        }
+        width = layout.width;
+        height = layout.height;
+        gray = layout.bitCount == 8 && layout.grayPalette;
+    }
+    else if (img.empty()) {
+        return false;
+    }
+    Pipeline pipeline;
+    pipeline.setLowMemory(spec.lowMemory);
+    Pipeline::NodeRef source = spec.roi ? pipeline.source(width, height, gray) : gray ? pipeline.source(img.gray.view()) : pipeline.source(img.pixels);
+    std::vector<BatchOutput> outputs = batchOutputs(pipeline, source, spec);
+    const Pipeline::NodeRef& compressed = outputs[0].node;
+    if (compressed->width <= 0 || compressed->height <= 0) {
+        std::cerr << "Compression scale leaves no pixels in " << inputPath << std::endl;
+        return false;
+    }
+    if (!spec.roi) {
+        for (const auto& [suffix, node] : outputs) {
+            // In low-memory mode contour maps are queued as bitmasks, a 24th of their pixels' size.
+            if (spec.lowMemory && node->op == Pipeline::Op::Contour) {
+                writer.enqueue(outputPrefix + suffix, pipeline.mask(node), node->gray);
+            }
+            else if (node->gray) {
+                writer.enqueue(outputPrefix + suffix, pipeline.outputGray(node));
+            }
+            else {
+                writer.enqueue(outputPrefix + suffix, pipeline.output(node));
+            }
+        }
+        return true;
+    }
+
+    if (spec.roiRect.clipped(compressed->width, compressed->height).empty()) {
+        std::cerr << "Region of interest is outside the image " << inputPath << std::endl;
+        return false;
+    }
+    bool unreadable = false;
+    pipeline.provide(source, [&](const Rect& window) {
+        Image pixels = readBMPAs<BGR24>(inputPath, window);
+        unreadable = unreadable || pixels.empty();
+        return pixels;
+    });
+    std::vector<Pipeline::NodeRef> nodes;
+    for (const auto& output : outputs) {
+        nodes.push_back(output.node);
+    }
+    std::vector<Image> regions = pipeline.evaluateRegions(nodes, spec.roiRect);
+    if (unreadable) {
+        return false;
+    }
+    // Regions are computed in BGR; for a grey node its channels are equal, so Gray8 loses nothing.
+    for (size_t i = 0; i < outputs.size(); i++) {
+        if (outputs[i].node->gray) {
+            writer.enqueue(outputPrefix + outputs[i].suffix, convertBMP<Gray8>(regions[i].view()));
+        }
+        else {
+            writer.enqueue(outputPrefix + outputs[i].suffix, std::move(regions[i]));
+        }
+    }
+    return true;
+}
+
+volatile uint32_t prefetchSink;
+
+template <typename Format>
+void touchPixels(const BasicImage<Format>& img) {
+    uint32_t checksum = 0;
+    for (int row = 0; row < img.height(); row++) {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(img[row]);
+        for (size_t byte = 0; byte < img.width() * sizeof(typename Format::Pixel); byte += 4096) {
+            checksum += bytes[byte];
+        }
+    }
+    prefetchSink = checksum;
+}
+
+// Reads `path` and faults its pixels in, so the I/O is done by the time the image is used. Meant to
+// run on a helper thread ahead of processing.
+Image prefetchBMP(const std::string& path) {
+    Image img = readBMP(path);
+    touchPixels(img);
+    return img;
+}
+
+// Like prefetchBMP, in the format readBatchImage picks.
+BatchImage prefetchBatchImage(const std::string& path) {
+    BatchImage img = readBatchImage(path);
+    touchPixels(img.pixels);
+    touchPixels(img.gray);
+    return img;
+}
+
+// Side of the square tiles sequence mode compares frames and recomputes outputs in. A multiple of 64,
+// so tiles side by side never share a Bitmask word.
+const int SEQUENCE_TILE = 64;
+
+// Which SEQUENCE_TILE tiles of a width x height image are marked. After finish() it answers "is any
+// tile under this rectangle marked" in constant time from a summed-area table of marks.
+class TileGrid {
+public:
+    TileGrid() = default;
+    TileGrid(int width, int height)
+        : width_(width), height_(height), across_((width + SEQUENCE_TILE - 1) / SEQUENCE_TILE),
+          down_((height + SEQUENCE_TILE - 1) / SEQUENCE_TILE), marked_(static_cast<size_t>(across_) * down_, 0) {}
+
+    int across() const { return across_; }
+    int down() const { return down_; }
+    int size() const { return across_ * down_; }
+    int count() const { return sums_.empty() ? 0 : sums_.back(); }
+
+    void mark(int tileRow, int tileCol) {
+        marked_[static_cast<size_t>(tileRow) * across_ + tileCol] = 1;
+    }
+    void markAll() {
+        std::fill(marked_.begin(), marked_.end(), 1);
+    }
+    bool marked(int tileRow, int tileCol) const {
+        return marked_[static_cast<size_t>(tileRow) * across_ + tileCol];
+    }
+    // Pixels of a tile, clipped to the image.
+    Rect tile(int tileRow, int tileCol) const {
+        return Rect{ tileRow * SEQUENCE_TILE, tileCol * SEQUENCE_TILE, SEQUENCE_TILE, SEQUENCE_TILE }.clipped(width_, height_);
+    }
+
+    void finish() {
+        sums_.assign(static_cast<size_t>(across_ + 1) * (down_ + 1), 0);
+        for (int r = 0; r < down_; r++) {
+            for (int c = 0; c < across_; c++) {
+                sums_[sumIndex(r + 1, c + 1)] = marked(r, c) + sums_[sumIndex(r, c + 1)] + sums_[sumIndex(r + 1, c)] - sums_[sumIndex(r, c)];
+            }
+        }
+    }
+    // Whether a marked tile overlaps pixel rectangle `rect`.
+    bool any(const Rect& rect) const {
+        Rect inside = rect.clipped(width_, height_);
+        if (inside.empty()) {
+            return false;
+        }
+        int top = inside.row / SEQUENCE_TILE, left = inside.col / SEQUENCE_TILE;
+        int bottom = (inside.row + inside.rows - 1) / SEQUENCE_TILE + 1, right = (inside.col + inside.cols - 1) / SEQUENCE_TILE + 1;
+        return sums_[sumIndex(bottom, right)] - sums_[sumIndex(top, right)] - sums_[sumIndex(bottom, left)] + sums_[sumIndex(top, left)] > 0;
+    }
+
+    // Marked tiles merged into horizontal runs, one rectangle per run. With every tile marked, the
+    // whole image as one rectangle.
+    std::vector<Rect> runs() const {
+        if (count() == size()) {
+            return { Rect{ 0, 0, height_, width_ } };
+        }
+        std::vector<Rect> runs;
+        for (int r = 0; r < down_; r++) {
+            for (int c = 0; c < across_; c++) {
+                if (!marked(r, c)) continue;
+                int first = c;
+                while (c + 1 < across_ && marked(r, c + 1)) c++;
+                runs.push_back(tile(r, first).united(tile(r, c)));
+            }
+        }
+        return runs;
+    }
+    // The smallest rectangle holding every marked tile.
+    Rect bounds() const {
+        Rect all;
+        for (const Rect& run : runs()) {
+            all = all.united(run);
+        }
+        return all;
+    }
+
+private:
+    size_t sumIndex(int r, int c) const {
+        return static_cast<size_t>(r) * (across_ + 1) + c;
+    }
+
+    int width_ = 0;
+    int height_ = 0;
+    int across_ = 0;
+    int down_ = 0;
+    std::vector<uint8_t> marked_;
+    std::vector<int> sums_;
+};
+
+// Tiles in which two images of the same size differ.
+TileGrid changedTilesBMP(const ImageView& previous, const ImageView& current) {
+    TileGrid changed(current.width, current.height);
+    threadPool().parallelFor(changed.down(), [&](int tileRow) {
+        for (int c = 0; c < changed.across(); c++) {
+            Rect tile = changed.tile(tileRow, c);
+            for (int x = tile.row; x < tile.row + tile.rows; x++) {
+                if (std::memcmp(previous[x] + tile.col, current[x] + tile.col, tile.cols * sizeof(RGBTRIPLE)) != 0) {
+                    changed.mark(tileRow, c);
+                    break;
+                }
+            }
+        }
+    });
+    changed.finish();
+    return changed;
+}
+
+// Tiles of a width x height output that depend on a marked tile of `input`, given the rectangle of
+// input each output tile reads.
+template <typename Reads>
+TileGrid dependentTiles(const TileGrid& input, int width, int height, Reads reads) {
+    TileGrid dependent(width, height);
+    for (int r = 0; r < dependent.down(); r++) {
+        for (int c = 0; c < dependent.across(); c++) {
+            if (input.any(reads(dependent.tile(r, c)))) {
+                dependent.mark(r, c);
+            }
+        }
+    }
+    dependent.finish();
+    return dependent;
+}
+
+// Runs a sequence of frames from a fixed camera through one BatchSpec, carrying each output over from
+// the previous frame and recomputing only the tiles a change can reach.
+//
+// Frames are compared tile by tile. The processed image is recomputed, with
+// Pipeline::evaluateRegion, in the tiles whose source pixels changed, and contour maps wherever that
+// can reach them (see updateContour); both come out exactly as a full run would. Lines are searched
+// for again over the whole edge map whenever it changed, so they too match a full run. The shape
+// fill is traced again whenever the processed image changed at all, since its region can grow
+// across the whole frame. The first frame, and any frame
+// whose size differs from the one before, is processed in full.
+class SequenceProcessor {
+public:
+    explicit SequenceProcessor(const BatchSpec& spec) : spec_(spec) {}
+
+    // Processes the next frame and queues its outputs on `writer`, named like processBatchFile's.
+    bool process(const Image& frame, const std::string& outputPrefix, AsyncWriter& writer) {
+        BMP_TRACE_SCOPE("frame");
+        Pipeline pipeline;
+        pipeline.setCache(nullptr);
+        std::vector<BatchOutput> outputs = batchOutputs(pipeline, pipeline.source(frame), spec_);
+        const Pipeline::NodeRef& compressed = outputs[0].node;
+        int width = compressed->width, height = compressed->height;
+        if (width <= 0 || height <= 0) {
+            std::cerr << "Compression scale leaves no pixels in the frame" << std::endl;
+            return false;
+        }
+
+        TileGrid changed(frame.width(), frame.height());
+        if (previous_.empty() || previous_.width() != frame.width() || previous_.height() != frame.height() ||
+            processed_.width() != width || processed_.height() != height) {
+            changed.markAll();
+            changed.finish();
+        }
+        else {
+            changed = changedTilesBMP(previous_.view(), frame.view());
+        }
+        previous_ = frame.alias();
+        changedTiles_ = changed.count();
+        totalTiles_ = changed.size();
+
+        TileGrid dirty = dependentTiles(changed, width, height, [&](const Rect& tile) {
+            return pipeline.sourceRegion(compressed, tile);
+        });
+        if (dirty.count() == dirty.size()) {
+            processed_ = pipeline.output(compressed);
+        }
+        else if (dirty.count() > 0) {
+            Image next(processed_.view());
+            patch(dirty, [&](const Rect& run) {
+                Image part = pipeline.evaluateRegion(compressed, run);
+                for (int x = 0; x < run.rows; x++) {
+                    std::memcpy(next[run.row + x] + run.col, part[x], run.cols * sizeof(RGBTRIPLE));
+                }
+            });
+            processed_ = std::move(next);
+        }
+
+        for (const auto& [suffix, node] : outputs) {
+            Image result;
+            if (node->op == Pipeline::Op::Shape) {
+                if (dirty.count() > 0 || shape_.empty()) {
+                    int origin[2] = { spec_.shapeOrigin[0], spec_.shapeOrigin[1] };
+                    shape_ = shapeDetectorBMP(processed_.view(), spec_.shapeTolerance, origin);
+                }
+                result = shape_.alias();
+            }
+            else if (node->op == Pipeline::Op::Contour) {
+                if (updateContour(contour_, dirty, spec_.contourTolerance, spec_.contourSkipRadius, spec_.edgeOperator).count() > 0 || contourImage_.empty()) {
+                    contourImage_ = maskImageBMP(contour_.kept);
+                }
+                result = contourImage_.alias();
+            }
+            else if (node->op == Pipeline::Op::Lines) {
+                updateLines(dirty);
+                result = lines_.alias();
+            }
+            else {
+                result = processed_.alias();
+            }
+            writer.enqueue(outputPrefix + suffix, std::move(result));
+        }
+        return true;
+    }
+
+    // Source tiles that differed from the previous frame in the last process() call, out of how many.
+    int changedTiles() const { return changedTiles_; }
+    int totalTiles() const { return totalTiles_; }
+
+private:
+    // Calls compute(run) for every run of marked tiles, across the pool. Each run is small, so the
+    // kernels inside it stay on the calling thread.
+    template <typename Compute>
+    void patch(const TileGrid& tiles, Compute compute) {
+        std::vector<Rect> runs = tiles.runs();
+        threadPool().parallelFor(int(runs.size()), [&](int i) {
+            if (runs.size() > 1) {
+                ThreadPool::InlineScope inlineKernels;
+                compute(runs[i]);
+            }
+            else {
+                compute(runs[i]);
+            }
+        });
+    }
+
+    // A contourMaskBMP map of the processed image, with the unthinned edges it was thinned from.
+    struct Contour {
+        Bitmask edges;
+        Bitmask kept;
+    };
+
+    // Brings `contour` up to date with the recomputed tiles of the processed image and returns the
+    // tiles of its thinned map that changed. The unthinned edges only reach as far as the blur and
+    // edge halo, so they are patched tile by tile; thinning is greedy in scan order and can carry a
+    // change any distance down the image, so it is redone row by row from the first patched row, the
+    // way suppressEdgesBMP corrects its bands, until past the last one and `skipRadius` rows in a row
+    // come out as they were.
+    TileGrid updateContour(Contour& contour, const TileGrid& dirty, int diffToleration, int skipRadius, EdgeOperator op = EdgeOperator::MaxChannelDifference) {
+        int width = processed_.width(), height = processed_.height();
+        TileGrid changed(width, height);
+        if (contour.edges.width() != width || contour.edges.height() != height) {
+            contour.edges = blurredEdgeMaskBMP(processed_.view(), diffToleration, op);
+            contour.kept = suppressEdgesBMP(contour.edges, skipRadius);
+            changed.markAll();
+            changed.finish();
+            return changed;
+        }
+        int halo = contourRegionHalo(0);
+        TileGrid reached = dependentTiles(dirty, width, height, [&](const Rect& tile) {
+            return tile.expanded(halo);
+        });
+        if (reached.count() == 0) {
+            changed.finish();
+            return changed;
+        }
+        patch(reached, [&](const Rect& run) {
+            Rect need = run.expanded(halo).clipped(width, height);
+            Bitmask part = blurredEdgeMaskBMP(processed_.sub(need.row, need.col, need.rows, need.cols), diffToleration, op);
+            for (int x = 0; x < run.rows; x++) {
+                for (int y = 0; y < run.cols; y++) {
+                    if (part.test(x + run.row - need.row, y + run.col - need.col)) {
+                        contour.edges.set(run.row + x, run.col + y);
+                    }
+                    else {
+                        contour.edges.reset(run.row + x, run.col + y);
+                    }
+                }
+            }
+        });
+
+        Rect patched = reached.bounds();
+        int words = contour.edges.wordsPerRow();
+        std::vector<uint64_t> redone(words);
+        int matching = 0;
+        for (int x = patched.row; x < height && (x < patched.row + patched.rows || matching < skipRadius); x++) {
+            if (skipRadius > 0) {
+                suppressEdgeRow(contour.edges, contour.kept, x, 0, skipRadius, redone.data());
+            }
+            else {
+                std::copy(contour.edges.row(x), contour.edges.row(x) + words, redone.begin());
+            }
+            uint64_t* row = contour.kept.row(x);
+            bool same = true;
+            for (int word = 0; word < words; word++) {
+                if (redone[word] != row[word]) {
+                    changed.mark(x / SEQUENCE_TILE, word * 64 / SEQUENCE_TILE);
+                    row[word] = redone[word];
+                    same = false;
+                }
+            }
+            matching = same ? matching + 1 : 0;
+        }
+        changed.finish();
+        return changed;
+    }
+
+    // The Hough vote is global, so whenever the line map changes the segments are searched for
+    // again over all of it; only the edge maps feeding it are patched.
+    void updateLines(const TileGrid& dirty) {
+        if (updateContour(lineContour_, dirty, LINE_CONTOUR_TOLERANCE, LINE_CONTOUR_SKIP_RADIUS).count() > 0) {
+            segments_ = detectLinesBMP(lineContour_.kept, spec_.maxBlankStreak, spec_.lineLengthMinimum, spec_.lineSkipRadius);
+        }
+        if (dirty.count() > 0 || lines_.empty()) {
+            lines_ = Image(processed_.view());
+            drawLinesBMP(lines_.view(), segments_);
+        }
+    }
+
+    BatchSpec spec_;
+    Image previous_;
+    Image processed_;
+    Image shape_;
+    Contour contour_;
+    Image contourImage_;
+    Contour lineContour_;
+    std::vector<LineSegment> segments_;
+    Image lines_;
+    int changedTiles_ = 0;
+    int totalTiles_ = 0;
+};
+
+// Paths matching a shell wildcard pattern, sorted. Without glob(3) the pattern is taken literally.
+std::vector<std::string> expandInputPattern(const std::string& pattern) {
+    std::vector<std::string> paths;
+#ifdef BMP_HAVE_MMAP
+    glob_t matches;
+    if (glob(pattern.c_str(), 0, nullptr, &matches) == 0) {
+        for (size_t i = 0; i < matches.gl_pathc; i++) {
+            paths.push_back(matches.gl_pathv[i]);
+        }
+    }
+    globfree(&matches);
+#else
+    paths.push_back(pattern);
+#endif
+    return paths;
+}
+
+// Parses the --filter and --size options shared by the stream and batch commands.
+bool parseResampleFilter(const std::string& name, ResampleFilter& filter) {
+    const std::pair<const char*, ResampleFilter> names[] = {
+        { "area", ResampleFilter::Area }, { "bilinear", ResampleFilter::Bilinear },
+        { "bicubic", ResampleFilter::Bicubic }, { "lanczos3", ResampleFilter::Lanczos3 },
+    };
+    for (const auto& [candidate, value] : names) {
+        if (name == candidate) {
+            filter = value;
+            return true;
+        }
+    }
+    std::cerr << "Unknown filter: " << name << std::endl;
+    return false;
+}
+
+bool parseEdgeOperator(const std::string& name, EdgeOperator& op) {
+    const std::pair<const char*, EdgeOperator> names[] = {
+        { "max", EdgeOperator::MaxChannelDifference }, { "sobel", EdgeOperator::Sobel }, { "scharr", EdgeOperator::Scharr },
+    };
+    for (const auto& [candidate, value] : names) {
+        if (name == candidate) {
+            op = value;
+            return true;
+        }
+    }
+    std::cerr << "Unknown edge operator: " << name << std::endl;
+    return false;
+}
+
+bool parseSize(const std::string& text, int& width, int& height) {
+    if (std::sscanf(text.c_str(), "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+        std::cerr << "Invalid size: " << text << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Parses argv[i] if it is one of the processing options shared by the batch, sequence and server modes,
+// leaving i on its last argument. Returns 1 if it was, 0 if it is not one of them and -1 if its
+// value is invalid.
+int parseSpecOption(int argc, char* argv[], int& i, BatchSpec& spec) {
+    std::string arg = argv[i];
+    if (arg == "--scale" && i + 1 < argc) {
+        spec.compressionScale = std::stof(argv[++i]);
+    }
+    else if (arg == "--size" && i + 1 < argc) {
+        if (!parseSize(argv[++i], spec.targetWidth, spec.targetHeight)) {
+            return -1;
+        }
+    }
+    else if (arg == "--filter" && i + 1 < argc) {
+        if (!parseResampleFilter(argv[++i], spec.filter)) {
+            return -1;
+        }
+    }
+    else if (arg == "--invert") {
+        spec.inverseColors = true;
+    }
+    else if (arg == "--negative") {
+        spec.pointOps.push_back(ChannelLUT::negative());
+    }
+    else if (arg == "--brightness" && i + 1 < argc) {
+        spec.pointOps.push_back(ChannelLUT::brightness(std::stoi(argv[++i])));
+    }
+    else if (arg == "--contrast" && i + 1 < argc) {
+        spec.pointOps.push_back(ChannelLUT::contrast(std::stod(argv[++i])));
+    }
+    else if (arg == "--gamma" && i + 1 < argc) {
+        double gamma = std::stod(argv[++i]);
+        if (gamma <= 0) {
+            std::cerr << "Gamma must be positive" << std::endl;
+            return -1;
+        }
+        spec.pointOps.push_back(ChannelLUT::gamma(gamma));
+    }
+    else if (arg == "--threshold" && i + 1 < argc) {
+        spec.pointOps.push_back(ChannelLUT::threshold(std::stoi(argv[++i])));
+    }
+    else if (arg == "--levels" && i + 4 < argc) {
+        int inLow = std::stoi(argv[++i]), inHigh = std::stoi(argv[++i]);
+        int outLow = std::stoi(argv[++i]), outHigh = std::stoi(argv[++i]);
+        spec.pointOps.push_back(ChannelLUT::levels(inLow, inHigh, outLow, outHigh));
+    }
+    else if (arg == "--posterize" && i + 1 < argc) {
+        spec.pointOps.push_back(ChannelLUT::posterize(std::stoi(argv[++i])));
+    }
+    else if (arg == "--blur") {
+        spec.blur = true;
+    }
+    else if (arg == "--sepia") {
+        spec.sepia = true;
+    }
+    else if (arg == "--shape" && i + 3 < argc) {
+        spec.detectShapes = true;
+        spec.shapeTolerance = std::stoi(argv[++i]);
+        spec.shapeOrigin[0] = std::stoi(argv[++i]);
+        spec.shapeOrigin[1] = std::stoi(argv[++i]);
+    }
+    else if (arg == "--contour" && i + 2 < argc) {
+        spec.contour = true;
+        spec.contourTolerance = std::stoi(argv[++i]);
+        spec.contourSkipRadius = std::stoi(argv[++i]);
+    }
+    else if (arg == "--edge-operator" && i + 1 < argc) {
+        if (!parseEdgeOperator(argv[++i], spec.edgeOperator)) {
+            return -1;
+        }
+    }
+    else if (arg == "--lines" && i + 3 < argc) {
+        spec.detectLines = true;
+        spec.maxBlankStreak = std::stoi(argv[++i]);
+        spec.lineLengthMinimum = std::stoi(argv[++i]);
+        spec.lineSkipRadius = std::stoi(argv[++i]);
+    }
+    else {
+        return 0;
+    }
+    return 1;
+}
+
+void displayMenu() {
+    std::cout << "=== BMP Image Processor ===" << std::endl;
+    std::cout << "Enter the path to the BMP file: ";
+}
+
+// bmpcv --stream <input.bmp> <output.bmp> [--scale S] [--size WxH] [--filter area|bilinear|bicubic|lanczos3] [--invert] [--blur] [--sepia] [--blur-sigma S] [--blur-edge clamp|mirror] [--strip-height N] [--threads N]
+int runStreamCommand(int argc, char* argv[]) {
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " --stream <input.bmp> <output.bmp> [--scale S] [--size WxH] [--filter area|bilinear|bicubic|lanczos3] [--invert] [--blur] [--sepia] [--blur-sigma S] [--blur-edge clamp|mirror] [--strip-height N] [--threads N]" << std::endl;
+        return 1;
+    }
+    std::string inputPath = argv[2], outputPath = argv[3];
+    float compressionScale = 1;
+    bool inverseColors = false, blur = false, sepia = false;
+    int stripHeight = 256;
+    float blurSigma = DEFAULT_BLUR_SIGMA;
+    EdgeMode blurEdge = EdgeMode::Clamp;
+    ResampleFilter filter = ResampleFilter::Area;
+    int targetWidth = 0, targetHeight = 0;
+    for (int i = 4; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--scale" && i + 1 < argc) {
+            compressionScale = std::stof(argv[++i]);
+        }
+        else if (arg == "--size" && i + 1 < argc) {
+            if (!parseSize(argv[++i], targetWidth, targetHeight)) {
+                return 1;
+            }
+        }
+        else if (arg == "--filter" && i + 1 < argc) {
+            if (!parseResampleFilter(argv[++i], filter)) {
+                return 1;
+            }
+        }
+        else if (arg == "--strip-height" && i + 1 < argc) {
+            stripHeight = std::stoi(argv[++i]);
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            setThreadCount(std::stoi(argv[++i]));
+        }
+        else if (arg == "--invert") {
+            inverseColors = true;
+        }
+        else if (arg == "--blur") {
+            blur = true;
+        }
+        else if (arg == "--blur-sigma" && i + 1 < argc) {
+            blur = true;
+            blurSigma = std::stof(argv[++i]);
+        }
+        else if (arg == "--blur-edge" && i + 1 < argc) {
+            blurEdge = std::string(argv[++i]) == "mirror" ? EdgeMode::Mirror : EdgeMode::Clamp;
+        }
+        else if (arg == "--sepia") {
+            sepia = true;
+        }
+        else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (compressionScale <= 0) {
+        std::cerr << "Compression scale must be positive" << std::endl;
+        return 1;
+    }
+    return streamBMP(inputPath, outputPath, compressionScale, inverseColors, blur, sepia, stripHeight, blurSigma, blurEdge, filter, targetWidth, targetHeight) ? 0 : 1;
+}
+
+// bmpcv --regions <input.bmp> <tolerance> <x,y> [<x,y> ...]
+// Labels the image once, prints area, bounding box and mean colour of the region under each seed,
+// and saves the selected regions to <input>-regions.bmp.
+int runRegionsCommand(int argc, char* argv[]) {
+    if (argc < 5) {
+        std::cerr << "Usage: " << argv[0] << " --regions <input.bmp> <tolerance> <x,y> [<x,y> ...]" << std::endl;
+        return 1;
+    }
+    std::string inputPath = argv[2];
+    Image img = readBMP(inputPath);
+    if (img.empty()) {
+        return 1;
+    }
+    RegionIndex index(img, std::stoi(argv[3]));
+    Image regions_img(img.width(), img.height());
+    for (int i = 4; i < argc; i++) {
+        int x, y;
+        if (std::sscanf(argv[i], "%d,%d", &x, &y) != 2 || x < 0 || y < 0 || x >= img.height() || y >= img.width()) {
+            std::cerr << "Invalid seed: " << argv[i] << std::endl;
+            return 1;
+        }
+        int label = index.label(x, y);
+        const RegionInfo& region = index.region(label);
+        std::cout << x << "," << y << ": region " << label << ", area " << region.area
+                  << ", bounds " << region.top << "," << region.left << " - " << region.bottom << "," << region.right
+                  << ", mean BGR " << int(region.meanColor.rgbtBlue) << " " << int(region.meanColor.rgbtGreen) << " " << int(region.meanColor.rgbtRed)
+                  << ", stddev BGR " << std::sqrt(region.variance[0]) << " " << std::sqrt(region.variance[1]) << " " << std::sqrt(region.variance[2]) << std::endl;
+        index.paint(img, label, regions_img);
+    }
+    std::ofstream ofile(inputPath + "-regions.bmp", std::ios::binary);
+    if (!ofile) {
+        std::cerr << "Unable to open output file" << std::endl;
+        return 1;
+    }
+    saveBMP(ofile, regions_img);
+    return 0;
+}
+
+// Peak resident set size of the process since the last resetPeakRSS() (or since it started), in
+// kilobytes (0 where unavailable).
+long peakRSSKilobytes() {
+#ifdef __linux__
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            return std::stol(line.substr(6));
+        }
+    }
+#endif
+#ifdef BMP_HAVE_MMAP
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+    }
+#endif
+    return 0;
+}
+
+// Lowers the peak peakRSSKilobytes() reports to the current resident size, so the next reading
+// covers only what happens from here on. Only Linux can do this; elsewhere the peak stays the
+// process-wide one.
+void resetPeakRSS() {
+#ifdef __linux__
+    std::ofstream clearRefs("/proc/self/clear_refs");
+    clearRefs << "5";
+#endif
+}
+
+// bmpcv --batch "<input glob>" <output dir> [--scale S] [--size WxH] [--filter F] [--invert] [point ops] [--blur] [--sepia]
+//       [--shape TOL X Y] [--contour TOL SKIP] [--edge-operator max|sobel|scharr] [--lines GAP MIN SKIP]
+//       [--jobs N] [--threads N] [--pool-mb N] [--cache DIR] [--cache-mb N] [--low-memory]
+// Processes every matching file with at most N (default: thread count) files in flight at once.
+// Pixel buffers are recycled through the pixel pool, capped at --pool-mb megabytes. --low-memory
+// trades speed for the smallest footprint: one file in flight unless --jobs says otherwise, no
+// read-ahead, intermediates freed as soon as they are used up, no pooled buffers unless --pool-mb
+// is given, and the peak memory reported at the end.
+int runBatchCommand(int argc, char* argv[]) {
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " --batch \"<input glob>\" <output dir> [--scale S] [--size WxH] [--filter area|bilinear|bicubic|lanczos3] [--invert] [--negative] [--brightness B] [--contrast C] [--gamma G] [--threshold T] [--levels IN_LO IN_HI OUT_LO OUT_HI] [--posterize N] [--blur] [--sepia] [--shape TOL X Y] [--contour TOL SKIP] [--edge-operator max|sobel|scharr] [--lines GAP MIN SKIP] [--roi X Y WxH] [--jobs N] [--threads N] [--pool-mb N] [--cache DIR] [--cache-mb N] [--low-memory]" << std::endl;
+        return 1;
+    }
+    std::string pattern = argv[2], outputDir = argv[3];
+    BatchSpec spec;
+    int jobs = 0;
+    bool poolLimited = false;
+    std::string cacheDir;
+    int cacheMegabytes = 1024;
+    for (int i = 4; i < argc; i++) {
+        std::string arg = argv[i];
+        int parsed = parseSpecOption(argc, argv, i, spec);
+        if (parsed < 0) {
+            return 1;
+        }
+        if (parsed > 0) {
+            continue;
+        }
+        if (arg == "--roi" && i + 3 < argc) {
+            spec.roi = true;
+            spec.roiRect.row = std::stoi(argv[++i]);
+            spec.roiRect.col = std::stoi(argv[++i]);
+            if (!parseSize(argv[++i], spec.roiRect.cols, spec.roiRect.rows)) {
+                return 1;
+            }
+        }
+        else if (arg == "--jobs" && i + 1 < argc) {
+            jobs = std::stoi(argv[++i]);
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            setThreadCount(std::stoi(argv[++i]));
+        }
+        else if (arg == "--cache" && i + 1 < argc) {
+            cacheDir = argv[++i];
+        }
+        else if (arg == "--cache-mb" && i + 1 < argc) {
+            cacheMegabytes = std::max(0, std::stoi(argv[++i]));
+        }
+        else if (arg == "--pool-mb" && i + 1 < argc) {
+            pixelPool().setLimit(size_t(std::max(0, std::stoi(argv[++i]))) << 20);
+            poolLimited = true;
+        }
+        else if (arg == "--low-memory") {
+            spec.lowMemory = true;
+        }
+        else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (spec.compressionScale <= 0) {
+        std::cerr << "Compression scale must be positive" << std::endl;
+        return 1;
+    }
+    if (!cacheDir.empty()) {
+        setResultCache(cacheDir, size_t(cacheMegabytes) << 20);
+    }
+    if (spec.lowMemory && !poolLimited) {
+        pixelPool().setLimit(0);
+    }
+    std::vector<std::string> inputs = expandInputPattern(pattern);
+    if (inputs.empty()) {
+        std::cerr << "No input files match " << pattern << std::endl;
+        return 1;
+    }
+#ifdef BMP_HAVE_MMAP
+    mkdir(outputDir.c_str(), 0755);
+#endif
+
+    // Each worker pulls the next file when it finishes one and reads the file after that on a helper
+    // thread meanwhile, so at most 2 * `jobs` inputs are resident; the kernels inside each job still
+    // spread over the whole thread pool. Outputs are written by one background thread.
+    jobs = std::max(1, std::min<int>(jobs > 0 ? jobs : spec.lowMemory ? 1 : threadPool().size(), inputs.size()));
+    std::atomic<size_t> next{0};
+    std::atomic<int> failed{0};
+    std::mutex outputMutex;
+    AsyncWriter writer(spec.lowMemory ? 1 : 2 * jobs + 2);
+    // With a region of interest each file reads just the part it needs itself; in low-memory mode
+    // each file is read only when its turn comes.
+    auto fetch = [&](size_t index) {
+        if (spec.roi) {
+            return std::async(std::launch::deferred, [] { return BatchImage(); });
+        }
+        return std::async(spec.lowMemory ? std::launch::deferred : std::launch::async, prefetchBatchImage, inputs[index]);
+    };
+    threadPool().parallelFor(jobs, [&](int) {
+        size_t i = next++;
+        std::future<BatchImage> upcoming;
+        if (i < inputs.size()) {
+            upcoming = fetch(i);
+        }
+        while (i < inputs.size()) {
+            BatchImage img = upcoming.get();
+            size_t following = next++;
+            if (following < inputs.size()) {
+                upcoming = fetch(following);
+            }
+            const std::string& inputPath = inputs[i];
+            std::string name = inputPath.substr(inputPath.find_last_of('/') + 1);
+            bool ok = processBatchFile(inputPath, img, outputDir + "/" + name, spec, writer);
+            failed += ok ? 0 : 1;
+            {
+                std::lock_guard<std::mutex> lock(outputMutex);
+                std::cout << inputPath << (ok ? ": done" : ": failed") << std::endl;
+            }
+            i = following;
+        }
+    });
+    int failedWrites = writer.finish();
+    std::cout << inputs.size() - failed << " of " << inputs.size() << " files processed" << std::endl;
+    if (spec.lowMemory) {
+        std::printf("Peak pixel memory: %.1f MB (peak RSS %.1f MB)\n", pixelPool().peakInUse() / 1048576.0, peakRSSKilobytes() / 1024.0);
+    }
+    if (failedWrites > 0) {
+        std::cerr << failedWrites << " output file(s) could not be written" << std::endl;
+    }
+    return failed > 0 || failedWrites > 0 ? 1 : 0;
+}
+
+// Processes the frames matching a pattern, in name order, as one sequence: each frame only redoes the
+// tiles that changed since the one before.
+int runSequenceCommand(int argc, char* argv[]) {
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " --sequence \"<frame glob>\" <output dir> [--scale S] [--size WxH] [--filter area|bilinear|bicubic|lanczos3] [--invert] [--negative] [--brightness B] [--contrast C] [--gamma G] [--threshold T] [--levels IN_LO IN_HI OUT_LO OUT_HI] [--posterize N] [--blur] [--sepia] [--shape TOL X Y] [--contour TOL SKIP] [--edge-operator max|sobel|scharr] [--lines GAP MIN SKIP] [--threads N]" << std::endl;
+        return 1;
+    }
+    std::string pattern = argv[2], outputDir = argv[3];
+    BatchSpec spec;
+    for (int i = 4; i < argc; i++) {
+        std::string arg = argv[i];
+        int parsed = parseSpecOption(argc, argv, i, spec);
+        if (parsed < 0) {
+            return 1;
+        }
+        if (parsed > 0) {
+            continue;
+        }
+        if (arg == "--threads" && i + 1 < argc) {
+            setThreadCount(std::stoi(argv[++i]));
+        }
+        else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
     }
-    return res;
-}
-int min(std::vector<int> nums) {
-    int res = INT_MAX;
-    for (int num : nums) {
-        res = std::min(res, num);
+    if (spec.compressionScale <= 0) {
+        std::cerr << "Compression scale must be positive" << std::endl;
+        return 1;
+    }
+    std::vector<std::string> frames = expandInputPattern(pattern);
+    if (frames.empty()) {
+        std::cerr << "No input files match " << pattern << std::endl;
+        return 1;
+    }
+#ifdef BMP_HAVE_MMAP
+    mkdir(outputDir.c_str(), 0755);
+#endif
+
+    // Frames depend on each other, so they go one at a time; the next one is read meanwhile.
+    SequenceProcessor sequence(spec);
+    AsyncWriter writer(8);
+    int failed = 0;
+    std::future<Image> upcoming = std::async(std::launch::async, prefetchBMP, frames[0]);
+    for (size_t i = 0; i < frames.size(); i++) {
+        Image frame = upcoming.get();
+        if (i + 1 < frames.size()) {
+            upcoming = std::async(std::launch::async, prefetchBMP, frames[i + 1]);
+        }
+        std::string name = frames[i].substr(frames[i].find_last_of('/') + 1);
+        if (frame.empty() || !sequence.process(frame, outputDir + "/" + name, writer)) {
+            failed++;
+            std::cout << frames[i] << ": failed" << std::endl;
+            continue;
+        }
+        std::cout << frames[i] << ": " << sequence.changedTiles() << " of " << sequence.totalTiles() << " tiles changed" << std::endl;
+    }
+    int failedWrites = writer.finish();
+    std::cout << frames.size() - failed << " of " << frames.size() << " frames processed" << std::endl;
+    if (failedWrites > 0) {
+        std::cerr << failedWrites << " output file(s) could not be written" << std::endl;
     }
-    return res;
+    return failed > 0 || failedWrites > 0 ? 1 : 0;
 }
 
-int clamp(int value, int min, int max) {
-    return std::max(min, std::min(max, value));
+// Deterministic test card: colour gradients, hard-edged rectangles and dark diagonal lines, plus
+// a little hashed noise, so blur, contour, shape and line detection all have real work to do.
+Image syntheticBMP(int width, int height) {
+    Image img(width, height);
+    parallelTiles(height, width, [&](int row, int col, int rows, int cols) {
+        for (int x = row; x < row + rows; x++) {
+            for (int y = col; y < col + cols; y++) {
+                uint32_t hash = uint32_t(x) * 2654435761u ^ uint32_t(y) * 2246822519u;
+                hash ^= hash >> 15;
+                int noise = int(hash & 15) - 8;
+                bool block = (x / 97 + y / 131) % 3 == 0;
+                bool line = (x + y) % 211 < 2 || (x - y + 100000) % 307 < 2;
+                RGBTRIPLE& pixel = img[x][y];
+                pixel.rgbtBlue = clamp((block ? 200 : x * 255 / height) + noise, 0, 255);
+                pixel.rgbtGreen = clamp((block ? 60 : y * 255 / width) + noise, 0, 255);
+                pixel.rgbtRed = clamp((block ? 30 : 128) + noise, 0, 255);
+                if (line) {
+                    pixel = { 10, 10, 10 };
+                }
+            }
+        }
+    });
+    return img;
 }
 
-std::vector<std::vector<RGBTRIPLE>> readBMP(std::ifstream& file) {
-    BITMAPFILEHEADER fileHeader;
-    BITMAPINFOHEADER infoHeader;
+// Keeps the compiler from discarding benchmark work whose result is otherwise unused.
+volatile uint32_t benchmarkSink;
 
-    file.read(reinterpret_cast<char*>(&fileHeader), sizeof(fileHeader));
-    file.read(reinterpret_cast<char*>(&infoHeader), sizeof(infoHeader));
+struct BenchResult {
+    std::string workload;
+    std::string image;
+    double megapixels;
+    double megapixelsPerSecond;
+    double nsPerPixel;
+    long peakRSSKilobytes;
+};
 
-    if (fileHeader.bfType != 0x4D42) {
-        std::cerr << "This is not a BMP file" << std::endl;
-        std::vector<std::vector<RGBTRIPLE>> blank_bmp;
-        return blank_bmp;
+// Best wall time of `run` in seconds over up to 10 repetitions or about half a second, whichever
+// comes first. `prepare` runs before every repetition, outside the timed region.
+double benchmarkSeconds(const std::function<void()>& prepare, const std::function<void()>& run) {
+    double best = 1e30, total = 0;
+    for (int rep = 0; rep < 10 && (rep == 0 || total < 0.5); rep++) {
+        prepare();
+        auto start = std::chrono::steady_clock::now();
+        run();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        best = std::min(best, seconds);
+        total += seconds;
     }
+    return std::max(best, 1e-9);
+}
 
-    file.seekg(fileHeader.bfOffBits, std::ios::beg);
+// Times every public operation on `img`, labelled `label` in the results. `scratchPath` is where
+// saveBMP writes and readBMP reads back.
+void benchmarkImage(const Image& img, const std::string& label, const std::string& scratchPath, std::vector<BenchResult>& results) {
+    double megapixels = double(img.width()) * img.height() / 1e6;
+    auto record = [&](const std::string& workload, const std::function<void()>& prepare, const std::function<void()>& run) {
+        resetPeakRSS();
+        double seconds = benchmarkSeconds(prepare, run);
+        BenchResult result = { workload, label, megapixels, megapixels / seconds, seconds * 1e3 / megapixels, peakRSSKilobytes() };
+        std::cout << workload << "\t" << label << "\t" << result.megapixelsPerSecond << " MP/s\t" << result.nsPerPixel << " ns/px" << std::endl;
+        results.push_back(result);
+    };
+    auto none = [] {};
 
-    int width = infoHeader.biWidth;
-    int height = infoHeader.biHeight;
-    int padding = (4 - (width * sizeof(RGBTRIPLE)) % 4) % 4;
+    Image work, output;
+    auto copyInput = [&] { work = img; };
+    auto resample = [&](float compressionScale) {
+        Pipeline pipeline;
+        pipeline.setCache(nullptr);
+        output = pipeline.take(pipeline.resample(pipeline.source(img), compressionScale, false));
+    };
 
-    std::vector<std::vector<RGBTRIPLE>> pixels(height, std::vector<RGBTRIPLE>(width));
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            file.read(reinterpret_cast<char*>(&pixels[i][j]), sizeof(RGBTRIPLE));
+    record("saveBMP", none, [&] {
+        std::ofstream ofile(scratchPath, std::ios::binary);
+        saveBMP(ofile, img);
+    });
+    record("readBMP", none, [&] {
+        // Mapping is lazy, so touch every row to pay for actually bringing the pixels in.
+        Image read_img = readBMP(scratchPath);
+        uint32_t checksum = 0;
+        for (int row = 0; row < read_img.height(); row++) {
+            checksum += read_img[row][0].rgbtBlue + read_img[row][read_img.width() - 1].rgbtRed;
+            for (int byte = 0; byte < read_img.width() * 3; byte += 4096) {
+                checksum += reinterpret_cast<const uint8_t*>(read_img[row])[byte];
+            }
         }
-        file.ignore(padding);
+        benchmarkSink = checksum;
+    });
+    std::remove(scratchPath.c_str());
+    record("compressBMP-down2", none, [&] { resample(2.0f); });
+    output = Image();
+    record("compressBMP-up2", none, [&] { resample(0.5f); });
+    output = Image();
+    record("sepiaBMP", copyInput, [&] { sepiaBMP(work); });
+    ChannelLUT pointOps = ChannelLUT::levels(16, 240, 0, 255).then(ChannelLUT::gamma(1.4)).then(ChannelLUT::posterize(8));
+    record("channelLUTBMP", copyInput, [&] { channelLUTBMP(work, pointOps); });
+    record("blurBMP", copyInput, [&] { blurBMP(work.view()); });
+    work = Image();
+    record("contourBMP", none, [&] { output = contourBMP(img, 35, 1); });
+    GrayImage gray = convertBMP<Gray8>(img.view());
+    record("contourMaskBMP-gray8", none, [&] { contourMaskBMP(gray.view(), 35, 1); });
+    gray = GrayImage();
+    record("shapeDetectorBMP", none, [&] {
+        int origin[2] = { img.height() / 2, img.width() / 2 };
+        output = shapeDetectorBMP(img.view(), 30, origin);
+    });
+    record("lineDetectorBMP", none, [&] { output = lineDetectorBMP(img, 5, 20, 2); });
+}
+
+// Writes results as tab-separated lines: workload, image, megapixels, MP/s, ns/pixel, peak RSS (KB).
+bool writeBenchResults(const std::string& path, const std::vector<BenchResult>& results) {
+    std::ofstream file(path);
+    if (!file) {
+        std::cerr << "Unable to open output file " << path << std::endl;
+        return false;
     }
-    return pixels;
+    file << "# workload\timage\tmegapixels\tmp_per_s\tns_per_pixel\tpeak_rss_kb\n";
+    for (const BenchResult& result : results) {
+        file << result.workload << "\t" << result.image << "\t" << result.megapixels << "\t" << result.megapixelsPerSecond
+             << "\t" << result.nsPerPixel << "\t" << result.peakRSSKilobytes << "\n";
+    }
+    return static_cast<bool>(file);
 }
 
-void colorBMP(std::vector<std::vector<RGBTRIPLE>>& img, bool inverseColors, int totalPixels, int x, int y, int sumBlue, int sumGreen, int sumRed) {
-    if (inverseColors) {
-        img[x][y].rgbtBlue = static_cast<uint8_t>(abs(max({sumRed, clamp(sumBlue + 10, 0, 255), sumGreen})) / totalPixels);
-        img[x][y].rgbtGreen = static_cast<uint8_t>(abs(max({sumRed, sumBlue, clamp(sumGreen + 10, 0, 255)})) / totalPixels);
-        img[x][y].rgbtRed = static_cast<uint8_t>(abs(max({clamp(sumRed + 10, 0, 255), sumBlue, sumGreen})) / totalPixels);
+bool readBenchResults(const std::string& path, std::vector<BenchResult>& results) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Unable to open baseline file " << path << std::endl;
+        return false;
     }
-    else {
-        img[x][y].rgbtBlue = static_cast<uint8_t>(sumBlue / totalPixels);
-        img[x][y].rgbtGreen = static_cast<uint8_t>(sumGreen / totalPixels);
-        img[x][y].rgbtRed = static_cast<uint8_t>(sumRed / totalPixels);
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        BenchResult result;
+        if (std::getline(fields, result.workload, '\t') && std::getline(fields, result.image, '\t') &&
+            fields >> result.megapixels >> result.megapixelsPerSecond >> result.nsPerPixel >> result.peakRSSKilobytes) {
+            results.push_back(result);
+        }
     }
+    return true;
 }
 
-void sepiaBMP(std::vector<std::vector<RGBTRIPLE>>& img) {
-    const std::vector<std::vector<double>> transform_vector = {
-        {0.393, 0.769, 0.189},
-        {0.349, 0.686, 0.168},
-        {0.272, 0.534, 0.131}
-    };
-    for (int x = 0; x < img.size(); x++) {
-        for (int y = 0; y < img[0].size(); y++) {
-            double newRed = 0.0, newGreen = 0.0, newBlue = 0.0;
-            for (int i = 0; i < 3; i++) {
-                newRed += img[x][y].rgbtRed * transform_vector[i][0];
-                newGreen += img[x][y].rgbtGreen * transform_vector[i][1];
-                newBlue += img[x][y].rgbtBlue * transform_vector[i][2];
+// Prints the throughput change of every result also present in `baseline` and returns how many
+// slowed down by more than `tolerancePercent`.
+int compareBenchResults(const std::vector<BenchResult>& baseline, const std::vector<BenchResult>& current, double tolerancePercent) {
+    int regressions = 0;
+    for (const BenchResult& now : current) {
+        for (const BenchResult& before : baseline) {
+            if (before.workload != now.workload || before.image != now.image) {
+                continue;
             }
-            img[x][y].rgbtRed = static_cast<uint8_t>(clamp(int(newRed), 0, 255));
-            img[x][y].rgbtGreen = static_cast<uint8_t>(clamp(int(newGreen), 0, 255));
-            img[x][y].rgbtBlue = static_cast<uint8_t>(clamp(int(newBlue), 0, 255));
+            double change = (now.megapixelsPerSecond / before.megapixelsPerSecond - 1) * 100;
+            bool regressed = change < -tolerancePercent;
+            regressions += regressed ? 1 : 0;
+            std::cout << (regressed ? "REGRESSION " : "           ") << now.workload << "\t" << now.image << "\t"
+                      << before.megapixelsPerSecond << " -> " << now.megapixelsPerSecond << " MP/s (" << (change >= 0 ? "+" : "") << change << "%), peak RSS "
+                      << before.peakRSSKilobytes / 1024 << " -> " << now.peakRSSKilobytes / 1024 << " MB" << std::endl;
         }
     }
+    return regressions;
 }
 
-void blurBMP(std::vector<std::vector<RGBTRIPLE>>& img) {
-    const std::vector<std::vector<double>> gauss_blur_matrix = {
-        {0.015, 0.125, 0.015},
-        {0.25, 0.0625, 0.25},
-        {0.015, 0.125, 0.015}
-    };
-    std::vector<std::vector<RGBTRIPLE>> temp_img = img;
-
-    for (int x = 0; x < img.size(); x++) {
-        for (int y = 0; y < img[0].size(); y++) {
-            double blue = 0.0, green = 0.0, red = 0.0;
-
-            for (int i = -1; i <= 1; i++) {
-                for (int j = -1; j <= 1; j++) {
-                    int xi = x + i;
-                    int yj = y + j;
-                    if (xi >= 0 && xi < img.size() && yj >= 0 && yj < img[0].size()) {
-                        blue += img[xi][yj].rgbtBlue * gauss_blur_matrix[i + 1][j + 1];
-                        green += img[xi][yj].rgbtGreen * gauss_blur_matrix[i + 1][j + 1];
-                        red += img[xi][yj].rgbtRed * gauss_blur_matrix[i + 1][j + 1];
-                    }
+// bmpcv --bench [--sizes 1,12,50,100] [--examples DIR] [--out FILE] [--baseline FILE] [--tolerance PCT] [--threads N]
+// Times each operation on synthetic images of the given megapixel sizes and on DIR/*.bmp (default
+// "example"), writes the results to FILE (default bench-results.tsv) and, given a baseline written
+// by an earlier run, flags operations whose throughput dropped by more than PCT percent (default 10).
+int runBenchCommand(int argc, char* argv[]) {
+    std::vector<double> sizes = { 1, 12, 50, 100 };
+    std::string examplesDir = "example", outputPath = "bench-results.tsv", baselinePath;
+    double tolerancePercent = 10;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--sizes" && i + 1 < argc) {
+            sizes.clear();
+            std::istringstream list(argv[++i]);
+            std::string size;
+            while (std::getline(list, size, ',')) {
+                if (!size.empty()) {
+                    sizes.push_back(std::stod(size));
                 }
             }
-
-            temp_img[x][y].rgbtBlue = static_cast<unsigned char>(blue);
-            temp_img[x][y].rgbtGreen = static_cast<unsigned char>(green);
-            temp_img[x][y].rgbtRed = static_cast<unsigned char>(red);
+        }
+        else if (arg == "--examples" && i + 1 < argc) {
+            examplesDir = argv[++i];
+        }
+        else if (arg == "--out" && i + 1 < argc) {
+            outputPath = argv[++i];
+        }
+        else if (arg == "--baseline" && i + 1 < argc) {
+            baselinePath = argv[++i];
+        }
+        else if (arg == "--tolerance" && i + 1 < argc) {
+            tolerancePercent = std::stod(argv[++i]);
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            setThreadCount(std::stoi(argv[++i]));
+        }
+        else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
         }
     }
-    img = temp_img;
-}
 
-std::vector<std::vector<RGBTRIPLE>> shapeDetectorBMP(std::vector<std::vector<RGBTRIPLE>>& img, int diffToleration, int shapeOrigin[2]) {
-    int height = img.size(), width = img[0].size();
-    int originX = shapeOrigin[0], originY = shapeOrigin[1];
-    std::vector<std::vector<RGBTRIPLE>> shape_detected_img(height, std::vector<RGBTRIPLE>(width));
-
-    auto isWithinTolerance = [&](RGBTRIPLE a, RGBTRIPLE b) {
-        return std::abs(a.rgbtBlue - b.rgbtBlue) <= diffToleration &&
-               std::abs(a.rgbtGreen - b.rgbtGreen) <= diffToleration &&
-               std::abs(a.rgbtRed - b.rgbtRed) <= diffToleration;
-    };
-
-    std::vector<std::vector<bool>> visited(height, std::vector<bool>(width, false));
-    std::stack<std::pair<int, int>> stack;
-    stack.push({ originX, originY });
-    RGBTRIPLE originColor = img[originX][originY];
-
-    while (!stack.empty()) {
-        auto [x, y] = stack.top();
-        stack.pop();
+    std::vector<BenchResult> baseline;
+    if (!baselinePath.empty() && !readBenchResults(baselinePath, baseline)) {
+        return 1;
+    }
 
-        if (x < 0 || y < 0 || x >= height || y >= width || visited[x][y] || !isWithinTolerance(img[x][y], originColor)) {
-            continue;
+    std::vector<BenchResult> results;
+    std::string scratchPath = outputPath + ".scratch.bmp";
+    for (double size : sizes) {
+        // 4:3 frames, like most camera output.
+        int height = std::max(1, int(std::lround(std::sqrt(size * 1e6 * 3 / 4))));
+        int width = std::max(1, int(std::lround(size * 1e6 / height)));
+        std::ostringstream label;
+        label << "synthetic-" << size << "MP";
+        benchmarkImage(syntheticBMP(width, height), label.str(), scratchPath, results);
+    }
+    if (!examplesDir.empty()) {
+        for (const std::string& path : expandInputPattern(examplesDir + "/*.bmp")) {
+            Image img = readBMP(path);
+            if (!img.empty()) {
+                benchmarkImage(img, path.substr(path.find_last_of('/') + 1), scratchPath, results);
+            }
         }
-
-        visited[x][y] = true;
-
-        shape_detected_img[x][y].rgbtRed = img[x][y].rgbtRed;
-        shape_detected_img[x][y].rgbtGreen = img[x][y].rgbtGreen;
-        shape_detected_img[x][y].rgbtBlue = img[x][y].rgbtBlue;
-
-        stack.push({ x + 1, y });
-        stack.push({ x - 1, y });
-        stack.push({ x, y + 1 });
-        stack.push({ x, y - 1 });
     }
-    return shape_detected_img;
+    if (!writeBenchResults(outputPath, results)) {
+        return 1;
+    }
+    std::cout << "Results written to " << outputPath << std::endl;
+    if (!baseline.empty()) {
+        int regressions = compareBenchResults(baseline, results, tolerancePercent);
+        std::cout << regressions << " regression(s) beyond " << tolerancePercent << "%" << std::endl;
+        return regressions > 0 ? 1 : 0;
+    }
+    return 0;
 }
 
-std::vector<std::vector<RGBTRIPLE>> contourBMP(std::vector<std::vector<RGBTRIPLE>>& img, int diffToleration, int skipRadius) {
-    int height = img.size(), width = img[0].size();
-    std::vector<std::vector<RGBTRIPLE>> mirror_img = img;
-    blurBMP(mirror_img);
-    auto isWithinTolerance = [&](RGBTRIPLE a, RGBTRIPLE b) {
-        return std::abs(b.rgbtBlue - a.rgbtBlue) > diffToleration ||
-               std::abs(b.rgbtRed - a.rgbtRed) > diffToleration ||
-               std::abs(b.rgbtGreen - a.rgbtGreen) > diffToleration;
-    };
-    auto isEdge = [&](std::array<int, 2> p1, std::array<int, 2> p2){
-    if (p1[0] < 0 || p2[0] < 0 || p1[0] >= height || p2[0] >= height || 
-        p1[1] < 0 || p2[1] < 0 || p1[1] >= width || p2[1] >= width) return false;
-    return isWithinTolerance(mirror_img[p1[0]][p1[1]], mirror_img[p2[0]][p2[1]]);
-    };
-    std::vector<std::vector<RGBTRIPLE>> contour_img(height, std::vector<RGBTRIPLE>(width));
-    std::vector<std::vector<bool>> skipMatrix(height, std::vector<bool>(width, false));
-    auto ignoreRadiusMatrixAgent = [height, width, skipRadius, &skipMatrix](std::array<int, 2> cords){
-        for (int x = cords[0]-skipRadius; x <= cords[0]+skipRadius; x++){
-            for (int y = cords[1]-skipRadius; y <= cords[1]+skipRadius; y++){
-                if (x < 0 || x >= height || y < 0 || y >= width) continue;
-                else{
-                    skipMatrix[x][y] = true;
-                }
+#ifdef BMP_HAVE_SOCKETS
+// Line and byte reads on a connected socket, buffered, and writes that send everything.
+class SocketStream {
+public:
+    explicit SocketStream(int fd) : fd_(fd) {}
+
+    // Reads up to the next newline (not included); fails at end of stream or past 64 KB.
+    bool readLine(std::string& line) {
+        size_t end;
+        while ((end = buffer_.find('\n')) == std::string::npos) {
+            if (buffer_.size() > (1 << 16) || !fill()) {
+                return false;
             }
         }
-    };
-    for(int x = 0; x < height; x++){
-        for (int y = 0; y < width; y++){
-            if (
-            !skipMatrix[x][y] &&
-            (isEdge({x, y}, {x, y+1}) || 
-            isEdge({x, y}, {x+1, y}) ||
-            isEdge({x, y}, {x-1, y}) ||
-            isEdge({x, y}, {x, y-1}) || 
-            isEdge({x, y}, {x-1, y-1}) || 
-            isEdge({x, y}, {x+1, y-1}) || 
-            isEdge({x, y}, {x-1, y+1}) || 
-            isEdge({x, y}, {x+1, y+1}))) {
-                contour_img[x][y] = {255, 255, 255};
-                ignoreRadiusMatrixAgent({x, y});
-            }
-    }
-    }
-    return contour_img;
-}
-
-std::vector<std::vector<RGBTRIPLE>> lineDetectorBMP(std::vector<std::vector<RGBTRIPLE>>& img, int maxBlankStreak, int lineLengthMinimum, int skipRadius) {
-    int height = img.size(), width = img[0].size();
-    const int sprayRadius = 1;
-    
-    auto contoured_img = contourBMP(img, 35, 0);
-    auto lineDetected_img = img;
-    
-    auto isPixelWhite = [&contoured_img, height, width](int x, int y) -> bool {
-        if (x < 0 || x >= height || y < 0 || y >= width) return false;
-        return (contoured_img[x][y].rgbtBlue == 255); // Assuming white pixels are (255, 255, 255)
-    };
-    
-    std::vector<std::vector<bool>> visited(height, std::vector<bool>(width, false));
-    auto visitedRadiusMatrixAgent = [height, width, skipRadius, &visited](std::array<int, 2> cords){
-        for (int x = cords[0]-skipRadius; x <= cords[0]+skipRadius; x++){
-            for (int y = cords[1]-skipRadius; y <= cords[1]+skipRadius; y++){
-                if (x < 0 || x >= height || y < 0 || y >= width) continue;
-                else{
-                    visited[x][y] = true;
-                }
+        line.assign(buffer_, 0, end);
+        buffer_.erase(0, end + 1);
+        return true;
+    }
+    bool readBytes(uint8_t* out, size_t count) {
+        size_t have = std::min(count, buffer_.size());
+        std::memcpy(out, buffer_.data(), have);
+        buffer_.erase(0, have);
+        while (have < count) {
+            ssize_t got = recv(fd_, out + have, count - have, 0);
+            if (got <= 0) {
+                return false;
             }
+            have += got;
         }
-    };
-    
-    std::function<CurveContainer(std::array<int, 2>, int, std::vector<std::array<int, 2>>, int, std::array<int, 2>)> bfs;
-    bfs = [&](std::array<int, 2> startCords, int actualBlankStreak, std::vector<std::array<int, 2>> path, int actualPathSum, std::array<int, 2> slope) -> CurveContainer {
-        std::queue<std::tuple<std::array<int, 2>, int, std::vector<std::array<int, 2>>, int>> q;
-        q.push({startCords, actualBlankStreak, path, actualPathSum});
-
-        while (!q.empty()) {
-            auto [cords, actualBlankStreak, path, actualPathSum] = q.front();
-            q.pop();
-
-            // Check bounds and blank streak limit
-            if (cords[0] < 0 || cords[0] >= height || cords[1] < 0 || cords[1] >= width || actualBlankStreak >= maxBlankStreak) {
-                int elementsToRemove = min({maxBlankStreak, path.size()});
-                for (int i = 0; i <= elementsToRemove-1; i++){
-                    path.pop_back();
-                }
-                return {actualPathSum-elementsToRemove-1, path};
-            }
-
-            bool isLineContinuous = false;
-            for (int x = cords[0] + slope[0] - sprayRadius; x <= cords[0] + slope[0] + sprayRadius; x++) {
-                for (int y = cords[1] + slope[1] - sprayRadius; y <= cords[1] + slope[1] + sprayRadius; y++) {
-                    if (isPixelWhite(x, y)) {
-                        cords[0] = x;
-                        cords[1] = y;
-                        isLineContinuous = true;
-                        visitedRadiusMatrixAgent({cords[0], cords[1]});
-                        actualBlankStreak = 0;
-                        break;
-                    }
-                }
-                if (isLineContinuous) break;
+        return true;
+    }
+    bool write(const void* data, size_t size) {
+        const char* bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t sent = send(fd_, bytes, size, 0);
+            if (sent <= 0) {
+                return false;
             }
+            bytes += sent;
+            size -= sent;
+        }
+        return true;
+    }
+    bool write(const std::string& text) {
+        return write(text.data(), text.size());
+    }
 
-            path.push_back(cords);
-            q.push({{cords[0] + slope[0], cords[1] + slope[1]}, actualBlankStreak + (isLineContinuous ? 0 : 1), path, actualPathSum + (isLineContinuous ? 1 : 0)});
+private:
+    bool fill() {
+        char chunk[4096];
+        ssize_t got = recv(fd_, chunk, sizeof(chunk), 0);
+        if (got <= 0) {
+            return false;
         }
+        buffer_.append(chunk, got);
+        return true;
+    }
 
-        // In case the loop exits without returning, which should not happen with the given conditions
-        return {0, {}};
-    };
-    
-    std::vector<std::array<int, 2>> lines;
-    
-    for (int x = 0; x < height; x++) {
-        for (int y = 0; y < width; y++) {
-            if (isPixelWhite(x, y) && !visited[x][y]) {
-                std::vector<CurveContainer> searchedLines;
-                for (int dx = -1; dx <= 1; dx++) {
-                    for (int dy = -1; dy <= 1; dy++) {
-                        if (!(dx == 0 && dy == 0)){
-                            CurveContainer curveInfo = bfs({ x, y }, 0, { {x, y} }, 0, { dx, dy });
-                            searchedLines.push_back(curveInfo);
-                        }
-                    }
-                }
-                CurveContainer bestCurve = {0, {}};
+    int fd_;
+    std::string buffer_;
+};
 
-                bool foundLongestPair = false;
-                int maxSumLength = 0;
-                std::array<int, 2> bestPairIndexes;
+// Admission and counters for the server: at most `slots` requests compute at once and the rest wait
+// their turn. Reports the queue, the totals, and latency percentiles over the last 1024 requests,
+// measured from the request arriving to its reply being sent.
+class ServerLoad {
+public:
+    explicit ServerLoad(int slots) : slots_(std::max(1, slots)) {}
 
-                if (searchedLines[0].lineLenght + searchedLines[7].lineLenght > maxSumLength) {
-                    maxSumLength = searchedLines[0].lineLenght + searchedLines[7].lineLenght;
-                    bestPairIndexes = {0, 7};
-                    foundLongestPair = true;
-                }
+    void enter() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        waiting_++;
+        changed_.wait(lock, [&] { return active_ < slots_; });
+        waiting_--;
+        active_++;
+    }
+    void leave() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        active_--;
+        changed_.notify_one();
+    }
+    void record(double milliseconds, bool ok) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        (ok ? served_ : failed_)++;
+        if (latencies_.size() < 1024) {
+            latencies_.push_back(milliseconds);
+        }
+        else {
+            latencies_[(served_ + failed_) % latencies_.size()] = milliseconds;
+        }
+    }
 
-                if (searchedLines[1].lineLenght + searchedLines[6].lineLenght > maxSumLength) {
-                    maxSumLength = searchedLines[1].lineLenght + searchedLines[6].lineLenght;
-                    bestPairIndexes = {1, 6};
-                    foundLongestPair = true;
-                }
+    std::string report() const {
+        std::vector<double> latencies;
+        std::ostringstream text;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            latencies = latencies_;
+            text << "queued=" << waiting_ << " active=" << active_ << " served=" << served_ << " failed=" << failed_;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) {
+            return latencies.empty() ? 0.0 : latencies[std::min(latencies.size() - 1, size_t(p * latencies.size()))];
+        };
+        text << std::fixed;
+        text.precision(2);
+        text << " p50_ms=" << percentile(0.5) << " p99_ms=" << percentile(0.99) << " max_ms=" << (latencies.empty() ? 0.0 : latencies.back());
+        return text.str();
+    }
 
-                if (searchedLines[2].lineLenght + searchedLines[5].lineLenght > maxSumLength) {
-                    maxSumLength = searchedLines[2].lineLenght + searchedLines[5].lineLenght;
-                    bestPairIndexes = {2, 5};
-                    foundLongestPair = true;
-                }
-                if (searchedLines[3].lineLenght + searchedLines[4].lineLenght > maxSumLength) {
-                    maxSumLength = searchedLines[3].lineLenght + searchedLines[4].lineLenght;
-                    bestPairIndexes = {3, 4};
-                    foundLongestPair = true;
-                }
+private:
+    mutable std::mutex mutex_;
+    std::condition_variable changed_;
+    int slots_;
+    int waiting_ = 0;
+    int active_ = 0;
+    long served_ = 0;
+    long failed_ = 0;
+    std::vector<double> latencies_;
+};
 
-                if (foundLongestPair && maxSumLength >= lineLengthMinimum) {
-                    bestCurve.lineLenght = maxSumLength;
-                    bestCurve.linePixels.clear();
-                    for(auto pixel : searchedLines[bestPairIndexes[0]].linePixels){
-                        bestCurve.linePixels.push_back(pixel);
-                    }
-                    for(auto pixel : searchedLines[bestPairIndexes[1]].linePixels){
-                        bestCurve.linePixels.push_back(pixel);
-                    }
-                }
+// The outputs of `spec` on `img`, as processBatchFile would write them.
+std::vector<std::pair<std::string, BatchImage>> serveOutputs(const BatchImage& img, const BatchSpec& spec) {
+    Pipeline pipeline;
+    Pipeline::NodeRef source = img.gray.empty() ? pipeline.source(img.pixels) : pipeline.source(img.gray.view());
+    std::vector<BatchOutput> outputs = batchOutputs(pipeline, source, spec);
+    std::vector<std::pair<std::string, BatchImage>> images;
+    if (outputs[0].node->width <= 0 || outputs[0].node->height <= 0) {
+        std::cerr << "Compression scale leaves no pixels" << std::endl;
+        return images;
+    }
+    for (const auto& [suffix, node] : outputs) {
+        images.push_back({ suffix, batchOutput(pipeline, node) });
+    }
+    return images;
+}
 
-                for (auto pixel : bestCurve.linePixels){
-                    lines.push_back(pixel);
-                }
-            }
+// Parses the processing options of a request, words[first] on, with the batch command's parser.
+bool parseRequestSpec(const std::vector<std::string>& words, size_t first, BatchSpec& spec) {
+    std::vector<char*> args;
+    for (const std::string& word : words) {
+        args.push_back(const_cast<char*>(word.c_str()));
+    }
+    for (int i = int(first); i < int(args.size()); i++) {
+        int parsed = parseSpecOption(int(args.size()), args.data(), i, spec);
+        if (parsed == 0) {
+            std::cerr << "Unknown option: " << args[i] << std::endl;
+        }
+        if (parsed <= 0) {
+            return false;
         }
     }
+    return spec.compressionScale > 0;
+}
 
-    for (const auto& coords : lines) {
-        int x = coords[0];
-        int y = coords[1];
-        if (x < 0 || x >= height || y < 0 || y >= width) continue;
-        lineDetected_img[x][y].rgbtBlue = 0;
-        lineDetected_img[x][y].rgbtGreen = 0;
-
+// Parses `text` as a whole base-10 count no greater than `limit`; false for anything else, so bad
+// input from the command line or the socket is rejected instead of throwing.
+bool parseCount(const std::string& text, unsigned long long limit, unsigned long long& value) {
+    if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0]))) {
+        return false;
     }
-    
-    return lineDetected_img;
+    char* end = nullptr;
+    errno = 0;
+    value = std::strtoull(text.c_str(), &end, 10);
+    return *end == '\0' && errno == 0 && value <= limit;
 }
 
-std::vector<std::vector<RGBTRIPLE>> compressBMP(std::vector<std::vector<RGBTRIPLE>>& img, float compressionScale, bool inverseColors, bool blur, bool sepia) {
-    std::vector<std::vector<RGBTRIPLE>> compressed_img;
+// Reads the BMP bytes that follow a process-bytes line, before the request waits for a compute slot,
+// so a slow sender holds only its own connection. Returns false, with the error in `reply`, when the
+// length is invalid or over `maxBytes` or the bytes stop short; the stream cannot be resynchronised
+// after that.
+bool readRequestPayload(const std::vector<std::string>& words, SocketStream& stream, size_t maxBytes, std::shared_ptr<std::vector<uint8_t>>& payload, std::string& reply) {
+    if (words[0] != "process-bytes" || words.size() < 2) {
+        return true;
+    }
+    unsigned long long size = 0;
+    if (!parseCount(words[1], maxBytes, size)) {
+        reply = "error invalid length\n";
+        return false;
+    }
+    payload = std::make_shared<std::vector<uint8_t>>(size);
+    if (!stream.readBytes(payload->data(), size)) {
+        reply = "error truncated request\n";
+        return false;
+    }
+    return true;
+}
 
-    int new_width = int(img[0].size() / compressionScale);
-    int new_height = int(img.size() / compressionScale);
-    std::cout << new_width << " : " << new_height << std::endl;
-    compressed_img.resize(new_height);
-    if (compressionScale >= 1) {
-        for (int x = 0; x < new_height; ++x) {
-            compressed_img[x].resize(new_width);
-            for (int y = 0; y < new_width; ++y) {
-                int sumBlue = 0, sumGreen = 0, sumRed = 0;
-                for (int i = 0; i < compressionScale; ++i) {
-                    for (int j = 0; j < compressionScale; ++j) {
-                        sumBlue += img[x * compressionScale + i][y * compressionScale + j].rgbtBlue;
-                        sumGreen += img[x * compressionScale + i][y * compressionScale + j].rgbtGreen;
-                        sumRed += img[x * compressionScale + i][y * compressionScale + j].rgbtRed;
-                    }
-                }
-                int totalPixels = compressionScale * compressionScale;
-                colorBMP(compressed_img, inverseColors, totalPixels, x, y, sumBlue, sumGreen, sumRed);
+// Answers one request; `words` is its line split at whitespace and `payload` the bytes that came
+// with it (see readRequestPayload). Returns false for a request that failed (the error is in `reply`).
+bool serveRequest(const std::vector<std::string>& words, const std::shared_ptr<std::vector<uint8_t>>& payload, std::string& reply) {
+    const std::string& command = words[0];
+    BatchSpec spec;
+    if (command == "process" && words.size() >= 3) {
+        if (!parseRequestSpec(words, 3, spec)) {
+            reply = "error invalid options\n";
+            return false;
+        }
+        BatchImage img = readBatchImage(words[1]);
+        if (img.empty()) {
+            reply = "error cannot read " + words[1] + "\n";
+            return false;
+        }
+        std::vector<std::pair<std::string, BatchImage>> outputs = serveOutputs(img, spec);
+        if (outputs.empty()) {
+            reply = "error no pixels left\n";
+            return false;
+        }
+        reply = "ok " + std::to_string(outputs.size()) + "\n";
+        for (const auto& [suffix, pixels] : outputs) {
+            bool saved = pixels.gray.empty() ? saveBMPFile(words[2] + suffix, pixels.pixels.view()) : saveBMPFile(words[2] + suffix, pixels.gray.view());
+            if (!saved) {
+                reply = "error cannot write " + words[2] + suffix + "\n";
+                return false;
             }
+            reply += words[2] + suffix + "\n";
         }
+        return true;
     }
-    else {
-        for (int x = 0; x < new_height; ++x) {
-            compressed_img[x].resize(new_width);
-            for (int y = 0; y < new_width; ++y) {
-                RGBTRIPLE origin_pixel = img[clamp(int(x * compressionScale), 0, img.size() - 1)][clamp(int(y * compressionScale), 0, img[0].size() - 1)];
-                compressed_img[x][y].rgbtBlue = origin_pixel.rgbtBlue;
-                compressed_img[x][y].rgbtGreen = origin_pixel.rgbtGreen;
-                compressed_img[x][y].rgbtRed = origin_pixel.rgbtRed;
+    if (command == "process-bytes" && payload) {
+        if (!parseRequestSpec(words, 2, spec)) {
+            reply = "error invalid options\n";
+            return false;
+        }
+        BMPLayout layout;
+        BatchImage img;
+        std::shared_ptr<uint8_t> data(payload, payload->data());
+        if (parseBMPLayout(data.get(), payload->size(), layout) && layout.bitCount == 8 && layout.grayPalette) {
+            img.gray = decodeBMPBytes<Gray8>(data, payload->size());
+        }
+        else {
+            img.pixels = decodeBMPBytes<BGR24>(data, payload->size());
+        }
+        if (img.empty()) {
+            reply = "error cannot decode input\n";
+            return false;
+        }
+        std::vector<std::pair<std::string, BatchImage>> outputs = serveOutputs(img, spec);
+        if (outputs.empty()) {
+            reply = "error no pixels left\n";
+            return false;
+        }
+        reply = "ok " + std::to_string(outputs.size()) + "\n";
+        for (const auto& [suffix, pixels] : outputs) {
+            std::ostringstream encoded;
+            if (pixels.gray.empty()) {
+                saveBMP(encoded, pixels.pixels.view());
             }
+            else {
+                saveBMP(encoded, pixels.gray.view());
+            }
+            std::string file = encoded.str();
+            reply += suffix + " " + std::to_string(file.size()) + "\n" + file;
         }
+        return true;
     }
-    if (blur) {
-        blurBMP(compressed_img);
-    }
-    if (sepia) {
-        sepiaBMP(compressed_img);
-    }
+    reply = "error unknown request " + command + "\n";
+    return false;
+}
 
-    return compressed_img;
+std::vector<std::string> splitWords(const std::string& line) {
+    std::istringstream text(line);
+    std::vector<std::string> words;
+    std::string word;
+    while (text >> word) {
+        words.push_back(word);
+    }
+    return words;
 }
 
-void saveBMP(std::ofstream& file, const std::vector<std::vector<RGBTRIPLE>>& pixels) {
-    int height = pixels.size();
-    int width = pixels[0].size();
-    int padding = (4 - (width * sizeof(RGBTRIPLE)) % 4) % 4;
+// Serves requests on one connection until the client hangs up or asks the server to stop. The caller
+// closes `fd`.
+void serveConnection(int fd, ServerLoad& load, std::atomic<bool>& stopping, size_t maxPayload) {
+    SocketStream stream(fd);
+    std::string line;
+    while (!stopping && stream.readLine(line)) {
+        std::vector<std::string> words = splitWords(line);
+        if (words.empty()) {
+            continue;
+        }
+        if (words[0] == "stats") {
+            stream.write("ok " + load.report() + "\n");
+            continue;
+        }
+        if (words[0] == "shutdown") {
+            stopping = true;
+            stream.write("ok\n");
+            break;
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::string reply;
+        std::shared_ptr<std::vector<uint8_t>> payload;
+        if (!readRequestPayload(words, stream, maxPayload, payload, reply)) {
+            stream.write(reply);
+            load.record(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(), false);
+            break;
+        }
+        bool ok;
+        load.enter();
+        try {
+            ok = serveRequest(words, payload, reply);
+        }
+        catch (const std::exception& error) {
+            reply = std::string("error ") + error.what() + "\n";
+            ok = false;
+        }
+        load.leave();
+        bool sent = stream.write(reply);
+        load.record(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(), ok);
+        if (!sent) {
+            break;
+        }
+    }
+}
 
-    BITMAPFILEHEADER fileHeader;
-    BITMAPINFOHEADER infoHeader;
+// Runs as a local server on a Unix domain socket, so callers that process many small images do not
+// pay for a process start, a cold thread pool and first-touch allocations on every one. Requests are
+// lines of whitespace-separated words, answered by a line starting "ok" or "error":
+//
+//   process <input> <output prefix> [options]    writes the outputs; replies with their paths
+//   process-bytes <length> [options]             followed by a BMP file of <length> bytes; replies
+//                                                with "<suffix> <length>" and the bytes per output
+//   stats                                        queue depth, totals and latency percentiles
+//   shutdown                                     stops the server once running requests finish
+//
+// Options are those of the batch command. Each connection has its own thread; at most `jobs`
+// requests compute at once, with their kernels spread over the shared thread pool. A process-bytes
+// payload over --max-request-mb (default 64) is refused and its connection closed.
+int runServeCommand(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " --serve <socket path> [--jobs N] [--threads N] [--pool-mb N] [--cache DIR] [--cache-mb N] [--max-request-mb N]" << std::endl;
+        return 1;
+    }
+    std::string socketPath = argv[2];
+    int jobs = 0;
+    std::string cacheDir;
+    int cacheMegabytes = 1024;
+    int maxRequestMegabytes = 64;
+    for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        unsigned long long value = 0;
+        bool numeric = arg == "--jobs" || arg == "--threads" || arg == "--pool-mb" || arg == "--cache-mb" || arg == "--max-request-mb";
+        if (numeric && (i + 1 >= argc || !parseCount(argv[i + 1], INT_MAX, value))) {
+            std::cerr << "Unknown option: " << arg << (i + 1 < argc ? std::string(" ") + argv[i + 1] : std::string()) << std::endl;
+            return 1;
+        }
+        if (arg == "--jobs") {
+            jobs = int(value);
+            i++;
+        }
+        else if (arg == "--threads") {
+            setThreadCount(int(value));
+            i++;
+        }
+        else if (arg == "--pool-mb") {
+            pixelPool().setLimit(size_t(value) << 20);
+            i++;
+        }
+        else if (arg == "--cache" && i + 1 < argc) {
+            cacheDir = argv[++i];
+        }
+        else if (arg == "--cache-mb") {
+            cacheMegabytes = int(value);
+            i++;
+        }
+        else if (arg == "--max-request-mb") {
+            maxRequestMegabytes = int(value);
+            i++;
+        }
+        else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (!cacheDir.empty()) {
+        setResultCache(cacheDir, size_t(cacheMegabytes) << 20);
+    }
 
-    fileHeader.bfType = 0x4D42;
-    fileHeader.bfSize = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + (sizeof(RGBTRIPLE) * width + padding) * height;
-    fileHeader.bfReserved1 = 0;
-    fileHeader.bfReserved2 = 0;
-    fileHeader.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path is too long" << std::endl;
+        return 1;
+    }
+    std::strcpy(address.sun_path, socketPath.c_str());
+    // A socket left behind by a server that died is replaced; anything else at the path is not.
+    struct stat existing;
+    if (lstat(socketPath.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+        unlink(socketPath.c_str());
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        std::cerr << "Unable to listen on " << socketPath << ": " << std::strerror(errno) << std::endl;
+        if (listener >= 0) {
+            close(listener);
+        }
+        return 1;
+    }
+    std::signal(SIGPIPE, SIG_IGN);
 
-    infoHeader.biSize = sizeof(BITMAPINFOHEADER);
-    infoHeader.biWidth = width;
-    infoHeader.biHeight = height;
-    infoHeader.biPlanes = 1;
-    infoHeader.biBitCount = 24;
-    infoHeader.biCompression = 0;
-    infoHeader.biSizeImage = (sizeof(RGBTRIPLE) * width + padding) * height;
-    infoHeader.biXPelsPerMeter = 0;
-    infoHeader.biYPelsPerMeter = 0;
-    infoHeader.biClrUsed = 0;
-    infoHeader.biClrImportant = 0;
+    // Start the pool and fill the pixel allocator before the first request rather than during it.
+    {
+        Pipeline pipeline;
+        pipeline.setCache(nullptr);
+        Image warm = syntheticBMP(512, 512);
+        pipeline.output(pipeline.contour(pipeline.blur(pipeline.source(warm)), 20, 1));
+    }
+    ServerLoad load(jobs > 0 ? jobs : threadPool().size());
+    std::atomic<bool> stopping{false};
+    struct Connection {
+        int fd;
+        std::atomic<bool> done{false};
+        std::thread thread;
+    };
+    std::list<Connection> connections;
+    std::cout << "Listening on " << socketPath << std::endl;
 
-    file.write(reinterpret_cast<char*>(&fileHeader), sizeof(fileHeader));
-    file.write(reinterpret_cast<char*>(&infoHeader), sizeof(infoHeader));
+    while (!stopping) {
+        connections.remove_if([](Connection& connection) {
+            if (connection.done) {
+                connection.thread.join();
+                close(connection.fd);
+            }
+            return connection.done.load();
+        });
+        pollfd ready = { listener, POLLIN, 0 };
+        if (poll(&ready, 1, 200) <= 0) {
+            continue;
+        }
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+        Connection& connection = connections.emplace_back();
+        connection.fd = fd;
+        connection.thread = std::thread([&] {
+            serveConnection(connection.fd, load, stopping, size_t(maxRequestMegabytes) << 20);
+            connection.done = true;
+        });
+    }
+    close(listener);
+    unlink(socketPath.c_str());
+    for (Connection& connection : connections) {
+        // Idle connections are blocked reading their next request; ending their input wakes them so
+        // they exit. Only the reading side is shut, so a request still computing sends its reply.
+        if (!connection.done) {
+            shutdown(connection.fd, SHUT_RD);
+        }
+        connection.thread.join();
+        close(connection.fd);
+    }
+    std::cout << "Stopped: " << load.report() << std::endl;
+    return 0;
+}
 
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            file.write(reinterpret_cast<const char*>(&pixels[i][j]), sizeof(RGBTRIPLE));
+int connectToServer(const std::string& socketPath) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path is too long" << std::endl;
+        return -1;
+    }
+    std::strcpy(address.sun_path, socketPath.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        std::cerr << "Unable to connect to " << socketPath << ": " << std::strerror(errno) << std::endl;
+        if (fd >= 0) {
+            close(fd);
         }
-        char paddingBytes[3] = { 0, 0, 0 };
-        file.write(paddingBytes, padding);
+        return -1;
     }
+    return fd;
 }
 
+// Client for --serve: sends one request (`--repeat N` times, for latency measurements) and prints
+// the reply. For process-bytes the input file is sent inline and the outputs that come back are
+// written next to `output prefix` locally.
+int runClientCommand(int argc, char* argv[]) {
+    int repeat = 1;
+    int first = 3;
+    unsigned long long rounds = 1;
+    if (argc > 4 && std::string(argv[3]) == "--repeat") {
+        first = parseCount(argv[4], INT_MAX, rounds) ? 5 : argc;
+        repeat = std::max(1, int(rounds));
+    }
+    if (argc <= first) {
+        std::cerr << "Usage: " << argv[0] << " --client <socket path> [--repeat N] process <input> <output prefix> [options] | process-bytes <input> <output prefix> [options] | stats | shutdown" << std::endl;
+        return 1;
+    }
+    std::vector<std::string> words(argv + first, argv + argc);
+    bool inlineBytes = words[0] == "process-bytes";
+    if (inlineBytes && words.size() < 3) {
+        std::cerr << "process-bytes needs an input file and an output prefix" << std::endl;
+        return 1;
+    }
+    std::string request;
+    std::vector<uint8_t> payload;
+    std::string outputPrefix;
+    if (inlineBytes) {
+        std::ifstream file(words[1], std::ios::binary);
+        if (!file) {
+            std::cerr << "Unable to open input file" << std::endl;
+            return 1;
+        }
+        payload.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        outputPrefix = words[2];
+        words.erase(words.begin() + 2);
+        words[1] = std::to_string(payload.size());
+    }
+    for (const std::string& word : words) {
+        request += (request.empty() ? "" : " ") + word;
+    }
+    request += "\n";
 
-void displayMenu() {
-    std::cout << "=== BMP Image Processor ===" << std::endl;
-    std::cout << "Enter the path to the BMP file: ";
+    std::signal(SIGPIPE, SIG_IGN);
+    int fd = connectToServer(argv[2]);
+    if (fd < 0) {
+        return 1;
+    }
+    SocketStream stream(fd);
+    std::vector<double> latencies;
+    int status = 0;
+    for (int round = 0; round < repeat && status == 0; round++) {
+        bool last = round == repeat - 1;
+        auto start = std::chrono::steady_clock::now();
+        std::string line;
+        if (!stream.write(request) || !stream.write(payload.data(), payload.size()) || !stream.readLine(line)) {
+            std::cerr << "Connection to the server was lost" << std::endl;
+            status = 1;
+            break;
+        }
+        std::vector<std::string> reply = splitWords(line);
+        if (reply.empty() || reply[0] != "ok") {
+            std::cerr << "Server: " << line << std::endl;
+            status = 1;
+            break;
+        }
+        if (words[0] == "process" || inlineBytes) {
+            unsigned long long outputs = 0;
+            if (reply.size() > 1 && !parseCount(reply[1], INT_MAX, outputs)) {
+                std::cerr << "Malformed reply from the server: " << line << std::endl;
+                status = 1;
+                break;
+            }
+            for (unsigned long long i = 0; i < outputs && status == 0; i++) {
+                if (!stream.readLine(line)) {
+                    status = 1;
+                    break;
+                }
+                if (!inlineBytes) {
+                    if (last) {
+                        std::cout << line << std::endl;
+                    }
+                    continue;
+                }
+                std::vector<std::string> header = splitWords(line);
+                unsigned long long size = 0;
+                if (header.size() != 2 || !parseCount(header[1], SIZE_MAX, size)) {
+                    std::cerr << "Malformed reply from the server: " << line << std::endl;
+                    status = 1;
+                    break;
+                }
+                std::vector<uint8_t> bytes(size);
+                if (!stream.readBytes(bytes.data(), bytes.size())) {
+                    status = 1;
+                    break;
+                }
+                if (last) {
+                    std::ofstream out(outputPrefix + header[0], std::ios::binary);
+                    out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+                    std::cout << outputPrefix + header[0] << std::endl;
+                }
+            }
+        }
+        else if (last) {
+            std::cout << line << std::endl;
+        }
+        latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    close(fd);
+    if (repeat > 1 && !latencies.empty()) {
+        std::sort(latencies.begin(), latencies.end());
+        std::printf("%zu requests: p50 %.2f ms, p99 %.2f ms, max %.2f ms\n", latencies.size(),
+            latencies[latencies.size() / 2], latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)], latencies.back());
+    }
+    return status;
 }
+#endif
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "--stream") {
+        return runStreamCommand(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--regions") {
+        return runRegionsCommand(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--batch") {
+        return runBatchCommand(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--sequence") {
+        return runSequenceCommand(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--bench") {
+        return runBenchCommand(argc, argv);
+    }
+#ifdef BMP_HAVE_SOCKETS
+    if (argc > 1 && std::string(argv[1]) == "--serve") {
+        return runServeCommand(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--client") {
+        return runClientCommand(argc, argv);
+    }
+#endif
 
-int main() {
     displayMenu();
 
     std::string inputPath;
     std::cin >> inputPath;
 
-    std::ifstream file(inputPath, std::ios::binary);
-    if (!file) {
-        std::cerr << "Unable to open input file" << std::endl;
-        return 1;
-    }
-
-    std::vector<std::vector<RGBTRIPLE>> img = readBMP(file);
-    file.close();
-
-    if (img.size() < 1) {
+    Image img = readBMP(inputPath);
+    if (img.empty()) {
         return 1;
     }
 
@@ -515,7 +6135,19 @@ int main() {
     bool contour = (contourChar == 'y');
     bool detectLine = (lineDetectChar == 'y');
 
-    std::vector<std::vector<RGBTRIPLE>> compressed_img = compressBMP(img, compressionScale, inverseColors, blur, sepia);
+    Pipeline pipeline;
+    Pipeline::NodeRef compressed = pipeline.resample(pipeline.source(img), compressionScale, inverseColors);
+    if (blur) {
+        compressed = pipeline.blur(compressed);
+    }
+    if (sepia) {
+        compressed = pipeline.sepia(compressed);
+    }
+    std::cout << compressed->width << " : " << compressed->height << std::endl;
+    // Outputs are written in the background, so the processed image is saved while the remaining
+    // prompts are answered.
+    AsyncWriter writer;
+    writer.enqueue(inputPath + "-processed.bmp", pipeline.output(compressed));
 
     if (detectShapes) {
         int diffTolerance;
@@ -527,14 +6159,7 @@ int main() {
         std::cout << "Enter origin Y: ";
         std::cin >> origin[1];
 
-        std::vector<std::vector<RGBTRIPLE>> shape_detected_img = shapeDetectorBMP(compressed_img, diffTolerance, origin);
-        std::ofstream ofile_shape_detected(inputPath + "-shape-processed.bmp", std::ios::binary);
-        if (!ofile_shape_detected) {
-            std::cerr << "Unable to open output file" << std::endl;
-            return 1;
-        }
-        saveBMP(ofile_shape_detected, shape_detected_img);
-        ofile_shape_detected.close();
+        writer.enqueue(inputPath + "-shape-processed.bmp", pipeline.output(pipeline.shape(compressed, diffTolerance, origin)));
     }
     if (contour){
         int diffTolerance;
@@ -544,14 +6169,7 @@ int main() {
         std::cout << "Enter skip radius: ";
         std::cin >> skipRadius;
 
-        std::vector<std::vector<RGBTRIPLE>> contour_img = contourBMP(compressed_img, diffTolerance, skipRadius);
-        std::ofstream ofile_contour(inputPath + "-contour.bmp", std::ios::binary);
-        if (!ofile_contour) {
-            std::cerr << "Unable to open output file" << std::endl;
-            return 1;
-        }
-        saveBMP(ofile_contour, contour_img);
-        ofile_contour.close();
+        writer.enqueue(inputPath + "-contour.bmp", pipeline.output(pipeline.contour(compressed, diffTolerance, skipRadius)));
     }
     if(detectLine){
         int maxBlankStreak, skipRadius, minimalLineLength;
@@ -561,24 +6179,8 @@ int main() {
         std::cin >> minimalLineLength;
         std::cout << "Enter skip radius: ";
         std::cin >> skipRadius;
-        std::vector<std::vector<RGBTRIPLE>> lineDetected_img = lineDetectorBMP(compressed_img, maxBlankStreak, minimalLineLength, skipRadius);
-        std::ofstream ofile_line(inputPath + "-line.bmp", std::ios::binary);
-        if (!ofile_line) {
-            std::cerr << "Unable to open output file" << std::endl;
-            return 1;
-        }
-        saveBMP(ofile_line, lineDetected_img);
-        ofile_line.close();
-    }
-
-    std::ofstream ofile(inputPath + "-processed.bmp", std::ios::binary);
-    if (!ofile) {
-        std::cerr << "Unable to open output file" << std::endl;
-        return 1;
+        writer.enqueue(inputPath + "-line.bmp", pipeline.output(pipeline.lines(compressed, maxBlankStreak, minimalLineLength, skipRadius)));
     }
 
-    saveBMP(ofile, compressed_img);
-    ofile.close();
-
-    return 0;
+    return writer.finish() > 0 ? 1 : 0;
 }